@@ -0,0 +1,311 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Translation of a lexed script to C, written with "q --emit-c".
+ *
+ * Each token becomes a labelled statement in main(), running the
+ * operator through the functions in qc.h. Ifs and elses jump to their
+ * labels directly; loops, returns, ends of called blocks and gotos
+ * continue through a switch on the index of the token. The script
+ * itself is kept for direct text and templates, and V0-V2, Vt and the
+ * block stack are held in a q_env, so the program behaves as the
+ * interpreter does.
+ *
+ * Including and executing code at runtime needs the interpreter, and
+ * such scripts are not translated.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+// Write text as a C string literal:
+static void emit_str(FILE *out,const utf8_t *p,int l) {
+	int i,c;
+	fputc('"',out);
+	for(i=0; i<l; ++i) {
+		if(i>0 && i%64==0) fputs("\"" STR_NL "\t\"",out);
+		c = p[i];
+		if(c=='"' || c=='\\' || c=='?') fputc('\\',out),fputc(c,out);
+		else if(c>=32 && c<127) fputc(c,out);
+		else fprintf(out,"\\%03o",c);
+	}
+	fputc('"',out);
+}
+
+static void emit_goto(FILE *out,q_env *e,int i) {
+	if(i<e->tok_len) fprintf(out,"goto t%d;",i);
+	else fputs("goto q_end;",out);
+}
+
+// Operators writing to V0 without freeing its string:
+static int emit_raw(int o) {
+	switch(o) {
+		case OP_ADD:case OP_SUB:case OP_MUL:case OP_DIV:case OP_MOD:
+		case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+		case OP_POW:case OP_SQRT:case OP_NOT:case OP_NOT2:case OP_ABS:case OP_NEG:
+		case OP_LSHIFT:case OP_RSHIFT:case OP_AND:case OP_OR:case OP_XOR:
+		case OP_LSHIFT2:case OP_RSHIFT2:case OP_AND2:case OP_OR2:case OP_XOR2:
+		case OP_INT:case OP_INT2:case OP_FLOAT:case OP_RED:
+			return 1;
+	}
+	return 0;
+}
+
+// Operators not using V0-V2:
+static int emit_flow(int o) {
+	switch(o) {
+		case OP_VAR:case OP_LEXPR:case OP_REXPR:case OP_LBLOCK:case OP_RBLOCK:
+		case OP_ELSE:case OP_IF:case OP_NIF:case OP_LOOP:case OP_RETURN:
+		case OP_DOUT:case OP_DOUTE:case OP_DSTRE:case OP_INDEX:case OP_CARET:
+		case OP_COPEN:case OP_CCLOSE:
+			return 1;
+	}
+	return 0;
+}
+
+static void emit_token(FILE *out,q_env *e,int i) {
+	q_token *t = &e->tok[i];
+	int o = t->op,n = 1,k;
+	const char *f;
+
+	fprintf(out,"t%d:",i);
+	if(t->len<=2 && e->src[t->pos]>32 && e->src[t->pos]<127 && e->src[t->pos]!='\\' &&
+		(t->len==1 || (e->src[t->pos+1]>32 && e->src[t->pos+1]<127 && e->src[t->pos+1]!='\\')))
+		fprintf(out," // %.*s",t->len,(char *)&e->src[t->pos]);
+	fputs(STR_NL,out);
+
+	if(!emit_flow(o) || ((o&0xE000) && t->arg))
+		fputs("\tv0 = e->v0,v1 = e->v1,v2 = e->v2;" STR_NL,out);
+	if((o&0xE000) && t->arg) { // Constant operand
+		n = 2,k = e->tok[i+1].arg;
+		if(k>=0) fprintf(out,"\tvar_set(&e->vt,&cst[%d]);" STR_NL,k);
+		else fprintf(out,"\tq_var_tpl(e,&e->vt,%d);" STR_NL,~k);
+		if(o&0x2000) fputs("\tv0 = &e->vt;" STR_NL,out);
+		else if(o&0x10000) fputs("\tv2 = &e->vt;" STR_NL,out);
+		else fputs("\tv1 = &e->vt,v2 = e->v1;" STR_NL,out);
+	}
+	if(emit_raw(o)) fputs("\ts = qc_s0(e,v0);" STR_NL,out);
+
+	switch(o) {
+		case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+		case OP_LSHIFT2:case OP_RSHIFT2:case OP_AND2:case OP_OR2:case OP_XOR2:
+			fputs("\tv2 = v0;" STR_NL,out);
+			break;
+		case OP_NOT2:case OP_INT2:
+			fputs("\tv1 = v0;" STR_NL,out);
+			break;
+		case OP_ELVIS2:
+			fputs("\tv2 = v1,v1 = v0;" STR_NL,out);
+			break;
+	}
+
+	f = NULL;
+	switch(o) {
+		case OP_ADD:case OP_ADD2:f = "qc_add";break;
+		case OP_SUB:case OP_SUB2:f = "qc_sub";break;
+		case OP_MUL:case OP_MUL2:f = "qc_mul";break;
+		case OP_DIV:case OP_DIV2:f = "qc_div";break;
+		case OP_MOD:case OP_MOD2:f = "qc_mod";break;
+		case OP_POW:f = "qc_pow";break;
+		case OP_RED:f = "qc_red";break;
+	}
+	if(f) fprintf(out,"\t%s(v0,v2,v1);" STR_NL,f);
+
+	switch(o) {
+		case OP_LSHIFT:case OP_RSHIFT:case OP_AND:case OP_OR:case OP_XOR:
+		case OP_LSHIFT2:case OP_RSHIFT2:case OP_AND2:case OP_OR2:case OP_XOR2:
+			fprintf(out,"\tqc_bits(%d,v0,v2,v1);" STR_NL,o&0xff);
+			break;
+		case OP_SQRT:fputs("\tqc_sqrt(v0,v1);" STR_NL,out);break;
+		case OP_INT:case OP_INT2:fputs("\tqc_int(v0,v1);" STR_NL,out);break;
+		case OP_FLOAT:fputs("\tqc_float(v0,v1);" STR_NL,out);break;
+		case OP_NOT:case OP_NOT2:
+			fputs("\tif(v1->type==INT) v0->i = ~v1->i,v0->type = INT;" STR_NL,out);
+			break;
+		case OP_ABS:
+			fputs("\tif(v1->type==FLOAT && v1->f<0.0) v0->f = -v1->f,v0->type = FLOAT;" STR_NL
+			      "\telse if(v1->type==INT && v1->i<0) v0->i = -v1->i,v0->type = INT;" STR_NL,out);
+			break;
+		case OP_NEG:
+			fputs("\tif(v1->type==FLOAT && v1->f>0.0) v0->f = -v1->f,v0->type = FLOAT;" STR_NL
+			      "\telse if(v1->type==INT && v1->i>0) v0->i = -v1->i,v0->type = INT;" STR_NL,out);
+			break;
+		case OP_FLOOR:fputs("\tif(v0->type==FLOAT) v0->f = floor(v0->f);" STR_NL,out);break;
+		case OP_CEIL:fputs("\tif(v0->type==FLOAT) v0->f = ceil(v0->f);" STR_NL,out);break;
+		case OP_INC:
+			fputs("\tif(v0->type==INT) ++v0->i;" STR_NL "\telse if(v0->type==FLOAT) ++v0->f;" STR_NL,out);
+			break;
+		case OP_DEC:
+			fputs("\tif(v0->type==INT) --v0->i;" STR_NL "\telse if(v0->type==FLOAT) --v0->f;" STR_NL,out);
+			break;
+
+		case OP_OUTPUT:fputs("\tq_output(e,v0);" STR_NL,out);break;
+		case OP_INPUT:fputs("\tq_input(e,v0,0);" STR_NL,out);break;
+		case OP_SET:fputs("\tvar_set(v0,v1);" STR_NL,out);break;
+		case OP_ELVIS:case OP_ELVIS2:
+			fputs("\tif(var_empty(v1)) v1 = v2;" STR_NL "\tvar_set(v0,v1);" STR_NL,out);
+			break;
+		case OP_NUM:case OP_DSTR:
+			fprintf(out,"\tvar_set(&e->vt,&cst[%d]);" STR_NL "\tvar_set(v0,&e->vt);" STR_NL,t->arg);
+			break;
+		case OP_STR:
+			if(t->arg>=0) fprintf(out,"\tvar_set(&e->vt,&cst[%d]);" STR_NL,t->arg);
+			else fprintf(out,"\tq_var_tpl(e,&e->vt,%d);" STR_NL,~t->arg);
+			fputs("\tvar_set(v0,&e->vt);" STR_NL,out);
+			break;
+		case OP_VAR:
+			fprintf(out,"\te->v2 = e->v1,e->v1 = e->v0,e->v0 = &e->va[%d];" STR_NL,t->arg);
+			break;
+		case OP_DOUT:
+			fprintf(out,"\tqc_dout(e,%ld,%d);" STR_NL,t->pos+2,t->arg);
+			break;
+		case OP_POS:
+			if(i+1<e->tok_len && t[1].op==OP_LBLOCK) {
+				fprintf(out,"\tvar_set_int(v0,%ld);" STR_NL "\t",t[1].pos);
+				emit_goto(out,e,t[1].jmp+1);
+				fputs(STR_NL,out);
+				return;
+			}
+			fprintf(out,"\tvar_set_int(v0,%ld);" STR_NL,t->pos+t->len-1);
+			break;
+
+		case OP_IS:case OP_NIS:case OP_EQ:case OP_NEQ:
+		case OP_LT:case OP_GT:case OP_LTEQ:case OP_GTEQ:
+			fprintf(out,"\tqc_expr(e,qc_cmp(%d,v0,v1));" STR_NL,o);
+			break;
+		case OP_NIF:
+			fputs("\te->b0->expr = !e->b0->expr;" STR_NL,out);
+		case OP_IF:
+			fputs("\tif(!qc_if(e)) ",out);
+			emit_goto(out,e,t->jmp+1);
+			fputs(STR_NL,out);
+			break;
+		case OP_ELSE:
+			fputs("\t",out);
+			emit_goto(out,e,t->jmp+1);
+			fputs(STR_NL,out);
+			return;
+		case OP_LEXPR:
+			fprintf(out,"\tif(!qc_lexpr(e)) { a = %d; goto q_overflow; }" STR_NL,i);
+			break;
+		case OP_REXPR:
+			fputs("\tif(!qc_rexpr(e)) goto q_end;" STR_NL,out);
+			break;
+		case OP_LBLOCK:
+			fprintf(out,"\tif(!qc_lblock(e,%d)) { a = %d; goto q_overflow; }" STR_NL,i,i);
+			break;
+		case OP_RBLOCK:
+			fputs("\tif((a=qc_rblock(e))>=0) goto q_jump;" STR_NL,out);
+			break;
+		case OP_LOOP:
+			fputs("\te->b0->expr = -1;" STR_NL "\ta = e->b0->pos;" STR_NL "\tgoto q_jump;" STR_NL,out);
+			return;
+		case OP_RETURN:
+			fputs("\ta = qc_return(e);" STR_NL "\tgoto q_jump;" STR_NL,out);
+			return;
+		case OP_GOTO:
+			fprintf(out,"\tif((a=qc_goto(e,v0,tok_pos,%d,%d))<-1) { a = %d; goto q_overflow; }" STR_NL
+			            "\tgoto q_jump;" STR_NL,e->tok_len,i,i);
+			return;
+	}
+
+	if(emit_raw(o)) fputs("\tqc_s1(s,v0);" STR_NL,out);
+	if(n==2) {
+		fputs("\t",out);
+		emit_goto(out,e,i+2);
+		fputs(STR_NL,out);
+	}
+}
+
+int q_emit_c(q_env *e,FILE *out,const char *file) {
+	int i,n = e->tok_len,m = e->tpl[e->tpl_len],raw = 0;
+	var *v;
+
+	for(i=0; i<n; ++i) {
+		if(e->tok[i].op==OP_INCLUDE || e->tok[i].op==OP_EXEC) {
+			q_oute(0,PACKAGE "[%ld]: %s" STR_NL,e->tok[i].pos,_("Include and exec can not be compiled to C"));
+			return 0;
+		}
+		if(emit_raw(e->tok[i].op)) raw = 1;
+	}
+
+	fprintf(out,"/* Generated by " PACKAGE " " PACKAGE_VERSION " --emit-c from \"%s\", compile with:" STR_NL
+	            " * cc -O2 -Iq/src -Iq/build/src -o prog prog.c q/src/io.c q/src/var.c q/src/str.c -lm" STR_NL
+	            " */" STR_NL "#include \"qc.h\"" STR_NL STR_NL,file);
+
+	fputs("static char script[] = ",out);
+	emit_str(out,e->src,e->len);
+	fputs(";" STR_NL STR_NL,out);
+
+	fputs("static const q_pos tok_pos[] = {",out);
+	for(i=0; i<n; ++i) fprintf(out,"%s%ld",i==0? "" : i%16==0? "," STR_NL "\t" : ",",e->tok[i].pos);
+	fputs(n==0? "0};" STR_NL : "};" STR_NL,out);
+
+	fputs("static q_seg seg[] = {" STR_NL,out);
+	for(i=0; i<m; ++i)
+		fprintf(out,"\t{ %ld, %d, %d }," STR_NL,e->seg[i].pos,e->seg[i].len,e->seg[i].var);
+	fputs(m==0? "\t{ 0, 0, -1 }" STR_NL "};" STR_NL : "};" STR_NL,out);
+
+	fputs("static int tpl[] = {",out);
+	for(i=0; i<=e->tpl_len; ++i) fprintf(out,"%s%d",i==0? "" : ",",e->tpl[i]);
+	fputs("};" STR_NL STR_NL,out);
+
+	fprintf(out,"int main(int argc,char **argv) {" STR_NL
+	            "\tq_block stack[STACK];" STR_NL
+	            "\tvar va[VARS],cst[%d] qc_unused;" STR_NL
+	            "\tq_env env = { src: (utf8_t *)script, len: %ld, seg: seg, tpl: tpl, tpl_len: %d, in: stdin, out: stdout, wr: q_writer_open(stdout,-1), rd: q_reader_open(stdin) },*e = &env;" STR_NL
+	            "\tvar *v0 qc_unused,*v1 qc_unused,*v2 qc_unused;" STR_NL
+	            "%s"
+	            "\tint a qc_unused;" STR_NL STR_NL
+	            "\tqc_open(e,stack,va,%d);" STR_NL,
+	            e->cst_len>0? e->cst_len : 1,e->len,e->tpl_len,raw? "\tstr *s;" STR_NL : "",n);
+	for(i=0; i<e->cst_len; ++i) {
+		v = &e->cst[i];
+		fprintf(out,"\tcst[%d] = ",i);
+		if(v->type==INT && v->i==LONG_MIN) fputs("(var){ type: INT, i: LONG_MIN };",out);
+		else if(v->type==INT) fprintf(out,"(var){ type: INT, i: %ldL };",v->i);
+		else if(v->type==FLOAT) fprintf(out,"(var){ type: FLOAT, f: %a };",v->f);
+		else if(v->type==STR) {
+			fputs("qc_str(",out);
+			emit_str(out,str_data(v->s),v->s->len);
+			fprintf(out,",%d);",(int)v->s->len);
+		} else fputs("(var){ type: VOID, i: 0 };",out);
+		fputs(STR_NL,out);
+	}
+	fputs(STR_NL,out);
+
+	for(i=0; i<n; ++i) emit_token(out,e,i);
+	fputs("\tgoto q_end;" STR_NL STR_NL,out);
+
+	fputs("q_jump: qc_unused; // Continue after token a" STR_NL "\tswitch(a) {" STR_NL,out);
+	for(i=-1; i+1<n; ++i) fprintf(out,"\t\tcase %d:goto t%d;" STR_NL,i,i+1);
+	fputs("\t}" STR_NL "\tgoto q_end;" STR_NL STR_NL,out);
+
+	fputs("q_overflow: qc_unused;" STR_NL
+	      "\tq_oute(0,PACKAGE \"[%ld]: %s\" STR_NL,tok_pos[a],_(\"Stack overflow\"));" STR_NL
+	      "q_end:" STR_NL
+	      "\tq_writer_close(e->wr);" STR_NL
+	      "\tq_reader_close(e->rd);" STR_NL
+	      "\tif(newline) q_outc(EOF,stdout);" STR_NL
+	      "\treturn 0;" STR_NL "}" STR_NL,out);
+	return 1;
+}
@@ -0,0 +1,381 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Compiled scripts, written with "q --compile" and run when given a file
+ * ending with ".qc".
+ *
+ * An image holds a lexed script: the tokens with their jumps resolved,
+ * template segments, compiled runs of tokens, the constant pool and the
+ * source. It holds no pointers, so the tokens, segments and runs are used
+ * where they are mapped. Only the constants are made into variables, with
+ * long strings as views of the image. The mapping is private and writable,
+ * as tokens are quickened while running.
+ *
+ * Images are only read by builds with the same version of the format,
+ * the same execution codes and the same sizes of types, and are checked
+ * before they are run.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+#define IMAGE_MAGIC         0x0a63517f // "\x7fQc\n"
+#define IMAGE_VERSION       2
+
+enum {
+	IMG_SRC,    // Source, with a terminating zero
+	IMG_TOK,    // Tokens
+	IMG_CST,    // Constants
+	IMG_STR,    // Strings of constants not in the source, each with a terminating zero
+	IMG_SEG,    // Template segments
+	IMG_TPL,    // Index of first segment for each template, and the number of segments
+	IMG_IR,     // Instructions of compiled runs
+	IMG_IRB,    // Compiled runs
+	IMG_SECT
+};
+
+typedef struct image_sect image_sect;
+typedef struct image_head image_head;
+typedef struct image_cst image_cst;
+
+struct image_sect {
+	q_pos off;  // Offset in image, aligned to 8 bytes
+	q_pos len;  // Length in bytes
+};
+
+struct image_head {
+	unsigned magic;
+	int version;
+	unsigned check; // Execution codes and sizes of types of the build
+	int flags;
+	q_pos pos;  // Position in source lexed from
+	image_sect sect[IMG_SECT];
+};
+
+struct image_cst {
+	int type;
+	int len;    // Length of string
+	union {
+		long i;
+		double f;
+		q_pos s; // Offset of string in image
+	};
+};
+
+static const int image_size[IMG_SECT] = {
+	1,sizeof(q_token),sizeof(image_cst),1,sizeof(q_seg),sizeof(int),sizeof(q_ir),sizeof(q_irb)
+};
+
+static unsigned image_check() {
+	unsigned i,n = EX_LEN;
+	for(i=0; i<IMG_SECT; ++i) n = n*31+image_size[i];
+	return (n*31+sizeof(q_pos))*31+sizeof(var);
+}
+
+// Write l bytes, padded to 8; returns the offset after:
+static q_pos image_put(FILE *out,const void *p,q_pos l,q_pos off) {
+	static const char pad[8] = { 0 };
+	if(l>0) fwrite(p,1,l,out);
+	if((off+l)&7) fwrite(pad,1,8-((off+l)&7),out);
+	return (off+l+7)&~7;
+}
+
+int q_image_write(q_script *sc,FILE *out) {
+	image_head h = { magic: IMAGE_MAGIC, version: IMAGE_VERSION, check: image_check(), flags: 0, pos: sc->pos };
+	image_cst *cst = (image_cst *)malloc(sizeof(image_cst)*(sc->cst_len+1));
+	const void *data[IMG_SECT] = { sc->src,sc->tok,cst,NULL,sc->seg,sc->tpl,sc->ir,sc->irb };
+	q_pos off,l = 0;
+	int i;
+	var *v;
+	if(!cst) return 0;
+	h.sect[IMG_SRC].len = sc->len+1;
+	h.sect[IMG_TOK].len = sizeof(q_token)*sc->tok_len;
+	h.sect[IMG_CST].len = sizeof(image_cst)*sc->cst_len;
+	h.sect[IMG_SEG].len = sizeof(q_seg)*sc->tpl[sc->tpl_len];
+	h.sect[IMG_TPL].len = sizeof(int)*(sc->tpl_len+1);
+	h.sect[IMG_IR].len  = sizeof(q_ir)*sc->ir_len;
+	h.sect[IMG_IRB].len = sizeof(q_irb)*sc->irb_len;
+	for(i=0,off=(sizeof(image_head)+7)&~7; i<IMG_STR; ++i)
+		h.sect[i].off = off,off = (off+h.sect[i].len+7)&~7;
+
+	// Strings in the source are referred to there, others follow the constants:
+	for(i=0; i<sc->cst_len; ++i) {
+		v = &sc->cst[i];
+		cst[i] = (image_cst){ type: v->type, len: 0, i: 0 };
+		if(v->type==INT) cst[i].i = v->i;
+		else if(v->type==FLOAT) cst[i].f = v->f;
+		else if(v->type==STR) {
+			cst[i].len = v->s->len;
+			if(v->s->data>=sc->src && v->s->data+v->s->len<=sc->src+sc->len)
+				cst[i].s = h.sect[IMG_SRC].off+(v->s->data-sc->src);
+			else cst[i].s = off+l,l += v->s->len+1;
+		}
+	}
+	h.sect[IMG_STR].len = l;
+	for(i=IMG_STR; i<IMG_SECT; ++i)
+		h.sect[i].off = off,off = (off+h.sect[i].len+7)&~7;
+
+	off = image_put(out,&h,sizeof(image_head),0);
+	fwrite(sc->src,1,sc->len,out);
+	off = image_put(out,"",1,off+sc->len);
+	for(i=IMG_TOK; i<IMG_STR; ++i)
+		off = image_put(out,data[i],h.sect[i].len,off);
+	for(i=0; i<sc->cst_len; ++i)
+		if((v=&sc->cst[i])->type==STR && cst[i].s>=h.sect[IMG_STR].off)
+			fwrite(str_data(v->s),1,v->s->len+1,out);
+	off = image_put(out,NULL,0,off+l);
+	for(i=IMG_STR+1; i<IMG_SECT; ++i)
+		off = image_put(out,data[i],h.sect[i].len,off);
+	free(cst);
+	fflush(out);
+	return !ferror(out);
+}
+
+#ifdef __unix__
+// Owned by the user and not writable by others:
+static int image_owned(struct stat *st) {
+	return st->st_uid==geteuid() && !(st->st_mode&(S_IWGRP|S_IWOTH));
+}
+#endif
+
+/* Map an image, private and writable. If own is set, only files owned by
+ * the user and not writable by others are mapped. */
+static str *image_map(const char *file,int own) {
+	str *s = NULL;
+	utf8_t *p;
+	FILE *fp;
+	long l,r;
+#ifdef __unix__
+	struct stat st;
+	int fd = open(file,O_RDONLY);
+	if(fd<0) return NULL;
+	if(fstat(fd,&st)==0 && (!own || image_owned(&st)) && S_ISREG(st.st_mode) && st.st_size>=(off_t)sizeof(image_head) &&
+			(p=mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0))!=MAP_FAILED)
+		s = str_new_map(p,(long)st.st_size);
+	close(fd);
+	if(s) return s;
+#endif
+	if(own) return NULL;
+	if((fp=fopen(file,"rb"))) {
+		fseek(fp,0,SEEK_END);
+		if((l=ftell(fp))>=(long)sizeof(image_head) && (p=(utf8_t *)malloc(l+1))) {
+			fseek(fp,0,SEEK_SET);
+			if((r=fread(p,1,l,fp))==l) s = str_new(p,l);
+			else free(p);
+		}
+		fclose(fp);
+	}
+	return s;
+}
+
+#define image_reg(r) ((r)>=0 && (r)<IR_REGS)
+
+// Tokens after a fused token, as set by lex_fuse:
+static int image_fused(const q_token *t,int n) {
+	switch(t->code) {
+		case EX_VAR2:       return t->op==OP_VAR && n>1 && t[1].op==OP_VAR;
+		case EX_VAR2_SET:   return t->op==OP_VAR && n>2 && t[1].op==OP_VAR && t[2].op==OP_SET;
+		case EX_VAR_OUTPUT: return t->op==OP_VAR && n>1 && t[1].op==OP_OUTPUT && !t[1].arg;
+		case EX_INC_CMP_IF: return t->op==OP_INC && n>2 && (!t[1].arg || (n>3 && t[2].op==OP_NUM));
+		default:            return 1;
+	}
+}
+
+/* Check in one pass that all indices in an image are within the arrays
+ * they index, and all positions within the source, so a damaged or
+ * altered image is not run. */
+static int image_valid(const image_head *h,const utf8_t *p) {
+	const utf8_t *src = &p[h->sect[IMG_SRC].off];
+	const q_token *tok = (const q_token *)&p[h->sect[IMG_TOK].off],*t;
+	const q_seg *seg = (const q_seg *)&p[h->sect[IMG_SEG].off];
+	const int *tpl = (const int *)&p[h->sect[IMG_TPL].off];
+	const q_ir *ir = (const q_ir *)&p[h->sect[IMG_IR].off];
+	const q_irb *irb = (const q_irb *)&p[h->sect[IMG_IRB].off],*b;
+	q_pos len = h->sect[IMG_SRC].len-1;
+	int tok_len = h->sect[IMG_TOK].len/sizeof(q_token),cst_len = h->sect[IMG_CST].len/sizeof(image_cst);
+	int seg_len = h->sect[IMG_SEG].len/sizeof(q_seg),tpl_len = h->sect[IMG_TPL].len/sizeof(int)-1;
+	int ir_len = h->sect[IMG_IR].len/sizeof(q_ir),irb_len = h->sect[IMG_IRB].len/sizeof(q_irb);
+	int i,j;
+	if(src[len]!='\0') return 0;
+	for(i=0; i<seg_len; ++i)
+		if(seg[i].pos<0 || seg[i].len<0 || seg[i].len>len-seg[i].pos ||
+				(seg[i].var!=-1 && seg[i].var!=VARS && (seg[i].var<0 || seg[i].var>=VARS))) return 0;
+	for(i=0; i<tpl_len; ++i)
+		if(tpl[i]<0 || tpl[i]>tpl[i+1]) return 0;
+	if(tpl[tpl_len]>seg_len) return 0;
+	for(i=0; i<ir_len; ++i)
+		if(ir[i].op<IR_NUM || ir[i].op>IR_DEC || ir[i].tok<0 || ir[i].tok>=tok_len ||
+				!image_reg(ir[i].d) || !image_reg(ir[i].b) ||
+				(ir[i].op==IR_NUM? ir[i].a<0 || ir[i].a>=cst_len : !image_reg(ir[i].a)) ||
+				!image_reg(ir[i].v[0]) || !image_reg(ir[i].v[1]) || !image_reg(ir[i].v[2])) return 0;
+	for(i=0,b=irb; i<irb_len; ++i,++b)
+		if(b->ir<0 || b->ir_len<0 || b->ir_len>ir_len-b->ir || b->tok<0 || b->end<b->tok || b->end>=tok_len ||
+				!image_reg(b->v[0]) || !image_reg(b->v[1]) || !image_reg(b->v[2])) return 0;
+	for(i=0,t=tok; i<tok_len; ++i,++t) {
+		if(t->code<=EX_NONE || t->code>=EX_LEN || (t->code<EX_FUSE && ex_op[t->code]!=t->op) ||
+				!image_fused(t,tok_len-i)) return 0;
+		if(t->jmp<-1 || t->jmp>=tok_len || t->pos<0 || t->len<0 || t->len>len-t->pos) return 0;
+		if(t->code==EX_IR && (t->jmp<0 || t->jmp>=irb_len || irb[t->jmp].tok!=i)) return 0;
+		j = t->arg;
+		switch(t->op) {
+			case OP_NUM:case OP_DSTR:
+				if(j<0 || j>=cst_len) return 0;
+				break;
+			case OP_STR: // Constant, or ~template
+				if(j>=cst_len || (j<0 && ~j>=tpl_len)) return 0;
+				break;
+			case OP_VAR:
+				if(j<0 || j>=VARS) return 0;
+				break;
+			case OP_DOUT:
+				if(j<0 || j>len-t->pos-2) return 0;
+				break;
+			default: // Followed by a constant
+				if((t->op&0xE000) && j && (i+1==tok_len || (t[1].op!=OP_NUM && t[1].op!=OP_STR))) return 0;
+		}
+	}
+	return 1;
+}
+
+q_script *q_image_open(const char *file,int own) {
+	str *s = image_map(file,own);
+	image_head *h;
+	image_cst *c;
+	q_script *sc;
+	utf8_t *p;
+	int i,n;
+	if(!s) return NULL;
+	p = s->data,h = (image_head *)p;
+	if(h->magic!=IMAGE_MAGIC || h->version!=IMAGE_VERSION || h->check!=image_check()) goto image_err;
+	for(i=0; i<IMG_SECT; ++i)
+		if((h->sect[i].off&7) || h->sect[i].off<(q_pos)sizeof(image_head) || h->sect[i].len<0 ||
+				h->sect[i].len>s->len-h->sect[i].off || h->sect[i].len%image_size[i]) goto image_err;
+	if(h->sect[IMG_SRC].len<1 || h->sect[IMG_TPL].len<(q_pos)sizeof(int) || !image_valid(h,p)) goto image_err;
+	if(!(sc=(q_script *)malloc(sizeof(q_script)))) goto image_err;
+	*sc = (q_script){
+		ref:     1,
+		image:   1,
+		src:     &p[h->sect[IMG_SRC].off],
+		src_s:   s,
+		len:     h->sect[IMG_SRC].len-1,
+		pos:     h->pos,
+		tok:     (q_token *)&p[h->sect[IMG_TOK].off],
+		tok_len: h->sect[IMG_TOK].len/sizeof(q_token),
+		cst:     NULL,
+		cst_len: 0,
+		seg:     (q_seg *)&p[h->sect[IMG_SEG].off],
+		tpl:     (int *)&p[h->sect[IMG_TPL].off],
+		tpl_len: h->sect[IMG_TPL].len/sizeof(int)-1,
+		ir:      (q_ir *)&p[h->sect[IMG_IR].off],
+		ir_len:  h->sect[IMG_IR].len/sizeof(q_ir),
+		irb:     (q_irb *)&p[h->sect[IMG_IRB].off],
+		irb_len: h->sect[IMG_IRB].len/sizeof(q_irb)
+	};
+
+	// Constants, with strings as in the lexer:
+	n = h->sect[IMG_CST].len/sizeof(image_cst);
+	c = (image_cst *)&p[h->sect[IMG_CST].off];
+	if(!(sc->cst=(var *)malloc(sizeof(var)*(n+1)))) {
+		free(sc);
+		goto image_err;
+	}
+	for(i=0; i<n; ++i,++c) {
+		var *v = &sc->cst[i];
+		*v = (var){ index: 0, type: VOID, i: 0 };
+		if(c->type==INT) v->i = c->i,v->type = INT;
+		else if(c->type==FLOAT) v->f = c->f,v->type = FLOAT;
+		else if(c->type==STR && c->len>=0 && c->s>=0 && c->s<=s->len-c->len) {
+			v->s = c->len>=STR_INLINE_LEN? str_intern_view(s,c->s,c->len) : str_intern(&p[c->s],c->len);
+			v->type = STR;
+		}
+		++sc->cst_len;
+	}
+if(verbose) q_outv(0,"%s [%ld]: %d %s, %d %s" STR_NL,_("Read compiled script"),s->len,sc->tok_len,_("tokens"),sc->cst_len,_("constants"));
+	return sc;
+
+image_err:
+	str_free(s);
+	return NULL;
+}
+
+
+/* Compiled scripts shared between processes are kept in a directory,
+ * named by a hash of the source, the position lexed from and whether
+ * debugging. An image is written to a temporary file and renamed, so
+ * it is complete when seen by other processes. The directory and the
+ * images must be owned by the user and not writable by others, as
+ * images are run without lexing the source. */
+static uint64_t image_hash(const utf8_t *p,q_pos l) {
+	uint64_t h = 14695981039346656037ull,w;
+	q_pos i;
+	for(i=0; i+8<=l; i+=8) { // A word at a time
+		memcpy(&w,&p[i],8);
+		h = (h^w)*1099511628211ull,h ^= h>>32;
+	}
+	for(; i<l; ++i) h = (h^p[i])*1099511628211ull;
+	return h;
+}
+
+int q_image_dir(const char *dir) {
+	int r = 0;
+#ifdef __unix__
+	struct stat st;
+	int fd = open(dir,O_RDONLY|O_DIRECTORY);
+	if(fd<0) return 0;
+	r = fstat(fd,&st)==0 && image_owned(&st);
+	close(fd);
+#endif
+if(verbose && !r) q_outv(0,"%s: %s" STR_NL,_("Cache directory not owned by user, or writable by others"),dir);
+	return r;
+}
+
+int q_image_name(char *file,int n,const char *dir,str *s,q_pos pos) {
+	uint64_t h = image_hash(s->data,s->len);
+	h = (h^pos)*1099511628211ull;
+	h = (h^debug)*1099511628211ull;
+	return snprintf(file,n,"%s/%016llx.qc",dir,(unsigned long long)h)<n;
+}
+
+int q_image_publish(q_script *sc,const char *file) {
+	int r = 0;
+#ifdef __unix__
+	char tmp[FILENAME_MAX];
+	FILE *fp;
+	int fd;
+	// Created readable and writable only by the user:
+	if(snprintf(tmp,sizeof(tmp),"%s.XXXXXX",file)>=(int)sizeof(tmp) || (fd=mkstemp(tmp))<0) return 0;
+	if(!(fp=fdopen(fd,"wb"))) close(fd);
+	else {
+		r = q_image_write(sc,fp);
+		if(fclose(fp)!=0) r = 0;
+		if(r) r = rename(tmp,file)==0;
+	}
+	if(!r) unlink(tmp);
+#endif
+	return r;
+}
@@ -0,0 +1,354 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Output and input of values, and rendering of templates. Shared by the
+ * interpreter and by scripts compiled to C with --emit-c.
+ */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __unix__
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+int debug = 0;
+int verbose = 0;
+int newline = 0;
+
+static q_writer *writers = NULL;
+
+static void q_flush_all() {
+	q_writer *w;
+	for(w=writers; w; w=w->next) q_flush(w);
+}
+
+void q_outv(int nl,const char *f, ...) {
+	va_list list;
+	q_flush_all();
+	va_start(list,f);
+	if(newline) fputs(STR_NL,stdout);
+	fputs(ANSI_COLOR_VERBOSE,stdout);
+	vfprintf(stdout,f,list);
+	fputs(ANSI_COLOR_RESET,stdout);
+	va_end(list);
+	newline = nl;
+}
+
+void q_outd(int nl,const char *f, ...) {
+	va_list list;
+	q_flush_all();
+	va_start(list,f);
+	if(newline) fputs(STR_NL,stderr);
+	fputs(ANSI_COLOR_DEBUG,stderr);
+	vfprintf(stderr,f,list);
+	fputs(ANSI_COLOR_RESET,stderr);
+	va_end(list);
+	newline = nl;
+}
+
+void q_oute(int nl,const char *f, ...) {
+	va_list list;
+	q_flush_all();
+	va_start(list,f);
+	if(newline) fputs(STR_NL,stderr);
+	fputs(ANSI_COLOR_ERROR,stderr);
+	vfprintf(stderr,f,list);
+	fputs(ANSI_COLOR_RESET,stderr);
+	va_end(list);
+	newline = nl;
+}
+
+void q_outc(int c,FILE *out) {
+	if(c=='\t' || (c>=32 && c<=127)) {
+		fputc(c,out);
+		newline = 1;
+	} else if(c=='\n' || c==EOF) {
+		fputs(STR_NL,out);
+		newline = 0;
+	}
+}
+
+// Flush policy is by line for terminals, else by block, when flush<0:
+q_writer *q_writer_open(FILE *fp,int flush) {
+	q_writer *w = (q_writer *)malloc(sizeof(q_writer));
+	if(!w) return NULL;
+#ifdef __unix__
+	if(flush<0) flush = isatty(fileno(fp))? FLUSH_LINE : FLUSH_BLOCK;
+#else
+	if(flush<0) flush = FLUSH_BLOCK;
+#endif
+	*w = (q_writer){ fp: fp, flush: flush, buf: (utf8_t *)malloc(WRITER_BUF), len: 0, cap: WRITER_BUF, next: writers };
+	writers = w;
+	return w;
+}
+
+void q_writer_close(q_writer *w) {
+	q_writer **p;
+	if(!w) return;
+	q_flush(w);
+	for(p=&writers; *p!=w; p=&(*p)->next);
+	*p = w->next;
+	free(w->buf);
+	free(w);
+}
+
+void q_flush(q_writer *w) {
+	if(w->len>0) fwrite(w->buf,1,w->len,w->fp),w->len = 0;
+	fflush(w->fp);
+}
+
+void q_write(q_writer *w,const utf8_t *p,int l) {
+	if(l<=0) return;
+	if(w->len+l>w->cap) {
+		if(w->flush==FLUSH_FULL) { // Keep all output until the end
+			utf8_t *b;
+			int n = w->cap*2>w->len+l? w->cap*2 : w->len+l;
+			if((b=(utf8_t *)realloc(w->buf,n))) w->buf = b,w->cap = n;
+			else q_flush(w);
+		} else q_flush(w);
+		if(l>w->cap) {
+			fwrite(p,1,l,w->fp);
+			return;
+		}
+	}
+	memcpy(&w->buf[w->len],p,l);
+	w->len += l;
+	if(w->flush==FLUSH_LINE && memchr(p,'\n',l)) q_flush(w);
+}
+
+// As q_outc:
+void q_outw(int c,q_writer *w) {
+	utf8_t b = c;
+	if(c=='\t' || (c>=32 && c<=127)) {
+		q_write(w,&b,1);
+		newline = 1;
+	} else if(c=='\n' || c==EOF) {
+		q_write(w,(const utf8_t *)STR_NL,sizeof(STR_NL)-1);
+		newline = 0;
+	}
+}
+
+q_reader *q_reader_open(FILE *fp) {
+	q_reader *r = (q_reader *)malloc(sizeof(q_reader));
+	if(r) *r = (q_reader){ fp: fp, buf: NULL, pos: 0, len: 0, eof: 0 }; // Buffer is allocated on first read
+	return r;
+}
+
+void q_reader_close(q_reader *r) {
+	if(!r) return;
+	str_free(r->buf);
+	free(r);
+}
+
+/* Move unread data to the start of the buffer, making room for at least
+ * as much again, and read what is available. A buffer still referenced
+ * by views is left to them, and the data is moved to a new buffer. */
+static int q_reader_fill(q_reader *r) {
+	str *b = r->buf;
+	int n = r->len-r->pos,m,k;
+	utf8_t *p;
+	m = n<READER_BUF/2? READER_BUF : n*2;
+	if(!b || b->ref>1 || m>b->cap) {
+		if(m<0 || !(p=(utf8_t *)malloc(m))) return -1;
+		if(n>0) memcpy(p,&b->data[r->pos],n);
+		str_free(b);
+		b = r->buf = str_new(NULL,0);
+		b->data = p,b->cap = m;
+	} else if(r->pos>0 && n>0) memmove(b->data,&b->data[r->pos],n);
+	r->pos = 0,r->len = n;
+#ifdef __unix__
+	do k = read(fileno(r->fp),&b->data[n],b->cap-n); // Returns what is available from pipes and terminals
+	while(k<0 && errno==EINTR);
+#else
+	k = fgets((char *)&b->data[n],b->cap-n,r->fp)? strlen((char *)&b->data[n]) : 0;
+#endif
+	if(k<=0) r->eof = 1;
+	else r->len += k;
+	return k;
+}
+
+/* Next line without the line break, or NULL at end of input. Lines of at
+ * least l bytes are cut to l when l>0. */
+str *q_read_line(q_reader *r,int l) {
+	utf8_t *p,*q;
+	int i = 0,n;
+	for(;;) {
+		if(r->buf && (q=(utf8_t *)memchr(&r->buf->data[r->pos+i],'\n',r->len-r->pos-i))) break;
+		i = r->len-r->pos; // Scanned so far
+		if(r->eof || q_reader_fill(r)<=0) {
+			if(r->pos==r->len) return NULL;
+			q = &r->buf->data[r->len]; // Last line without line break
+			break;
+		}
+	}
+	p = &r->buf->data[r->pos],n = q-p;
+	r->pos += n<r->len-r->pos? n+1 : n;
+	if(n>0 && p[n-1]=='\r') --n;
+	if(l>0 && n>l) n = l;
+	if(n<STR_INLINE_LEN) return str_new_dup(n>0? p : (const utf8_t *)"",n);
+	return str_view(r->buf,p-r->buf->data,n);
+}
+
+static int q_buf(q_env *e,int l) {
+	if(l>e->buf_cap) {
+		utf8_t *b = (utf8_t *)realloc(e->buf,l);
+		if(!b) return 0;
+		e->buf = b,e->buf_cap = l;
+	}
+	return 1;
+}
+
+void q_var_tpl(q_env *e,var *v,int n) {
+	q_seg *g = &e->seg[e->tpl[n]],*g1 = &e->seg[e->tpl[n+1]];
+	var *v1;
+	int l,m;
+	for(l=0; g<g1; ++g) {
+		if(!q_buf(e,l+g->len+1)) return;
+		memcpy(&e->buf[l],&e->src[g->pos],g->len);
+		l += g->len;
+		if(g->var<0) break;
+		v1 = g->var==VARS? &e->vt : &e->va[g->var];
+		if(v1->type==INT || v1->type==FLOAT) {
+			m = e->buf_cap-l;
+			while((n=v1->type==INT? snprintf((char *)&e->buf[l],m,"%ld",v1->i) :
+						snprintf((char *)&e->buf[l],m,"%g",v1->f))>=m)
+				if(!q_buf(e,l+(m=n+1))) return;
+			l += n;
+		} else if(v1->type==STR) {
+			if(!q_buf(e,l+v1->s->len+1)) return;
+			memcpy(&e->buf[l],v1->s->data,v1->s->len);
+			l += v1->s->len;
+		} else e->buf[l++] = '?';
+	}
+	if(!q_buf(e,l+1)) return;
+	e->buf[l] = '\0';
+	var_free(v);
+	v->type = STR,v->s = str_new_dup(e->buf,l);
+//if(debug) q_outd(0,"q_var_tpl(l: %d, s: %s)" STR_NL,l,s);
+if(verbose) q_outv(0,"%s: " ANSI_COLOR_YELLOW "\"%s\"" STR_NL,_("Created string"),(char *)str_data(v->s));
+}
+
+void q_input(q_env *e,var *v,int l) {
+	str *s;
+	if(!v) return;
+	if(e->wr) q_flush(e->wr); // Show output before waiting for input
+	if(!(s=q_read_line(e->rd,l))) s = str_new_dup((const utf8_t *)"",0);
+	var_free(v);
+	v->type = STR,v->s = s;
+	newline = 0;
+}
+
+/* Length of plain text at p, printable ascii other than & \ ^ and well-formed
+ * UTF-8, which is written as is. Ascii is checked 16 bytes at a time. */
+static long q_span(const utf8_t *p,long n) {
+	long i = 0;
+	int c,l;
+#ifdef __SSE2__
+	const __m128i v31 = _mm_set1_epi8(31),va = _mm_set1_epi8('&'),vb = _mm_set1_epi8('\\'),vc = _mm_set1_epi8('^');
+	__m128i x;
+#endif
+	while(i<n) {
+		c = p[i];
+		if(c>=0x80) {
+			if(c>=0xc2 && c<0xe0 && i+1<n && (p[i+1]&0xc0)==0x80) i += 2; // Two bytes, as hebrew
+			else if((l=utf8_valid(&p[i],n-i))) i += l;
+			else break;
+			continue;
+		}
+		if(c<32 || c=='&' || c=='\\' || c=='^') break;
+		++i;
+#ifdef __SSE2__
+		for(; i+16<=n; i+=16) {
+			x = _mm_loadu_si128((const __m128i *)&p[i]);
+			c = ~_mm_movemask_epi8(_mm_cmpgt_epi8(x,v31))&0xffff; // Control chars, and bytes from 0x80 as signed
+			c |= _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x,va),_mm_cmpeq_epi8(x,vb)),_mm_cmpeq_epi8(x,vc)));
+			if(c) {
+				i += __builtin_ctz(c);
+				break;
+			}
+		}
+#endif
+	}
+	return i;
+}
+
+void q_output(q_env *e,var *v) {
+	q_writer *w = e->wr;
+	char b[32];
+	if(v->type==VOID) q_write(w,(const utf8_t *)"?",1);
+	else if(v->type==INT) q_write(w,(const utf8_t *)b,snprintf(b,sizeof(b),"%ld",v->i));
+	else if(v->type==FLOAT) q_write(w,(const utf8_t *)b,snprintf(b,sizeof(b),"%g",v->f));
+	else {
+		if(v->type==STR && v->s && v->s->data) {
+			utf8_t *p = v->s->data,*p1 = p+v->s->len,*q; // Views are not terminated
+			int c = p<p1? *p : '\0';
+			if(c=='<') {
+				q_input(e,v,0);
+			} else {
+				var *v1;
+				int c0,n,a = 0;
+				const utf8_letter *g;
+//if(debug) q_outd(0,"q_output(\"%s\")" STR_NL,(char *)p);
+				while(p<p1 && (c=*p++)) {
+					if((q=p-1+q_span(p-1,p1-p+1))>p-1) { // Copy span of plain chars
+						q_write(w,p-1,q-p+1),p = q;
+						newline = 1;
+						continue;
+					}
+					if(c=='&') {
+						c0 = 0,c = p<p1? *p : '\0',n = 0;
+						if(/*c=='>' || */c=='<'/* || c=='|' || c=='%'*/) c0 = c,c = p+1<p1? p[++n] : '\0';
+						if(p+n+1<p1 && isunicode(c) && (g=utf8_lookup(&p[n]))->latin) c = g->latin,++n;
+						if(c=='*' ||
+						   (c>='A' && c<='Z' && (a=l2h[c-'A'])>=0) ||
+							(c>='a' && c<='z' && (a=l2h[c-'a'])>=0)) {
+							if(c=='*') v1 = &e->vt;
+							else v1 = &e->va[a];
+							if(c0) {
+								if(c0=='<') q_input(e,v1,0);
+							} else q_output(e,v1);
+							p += n+1;
+							continue;
+						}
+						if(c0) q_outw(c0,w);
+						c = p<p1? *p : '\0',++p;
+					}
+					else if(c=='\\') c = '\n';
+					else if(c=='^') c = '\t';
+					if(!isunicode(c)) q_outw(c,w);
+					else {
+						if(!(n=utf8_len(c))) n = 1;
+						q_write(w,p-1,p-1+n<=p1? n : p1-p+1),p += n-1;
+						newline = 1;
+					}
+				}
+			}
+		}
+		return;
+	}
+	newline = 1;
+}
+
@@ -0,0 +1,258 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Three-address code for straight runs of variable, number, arithmetic,
+ * set, increment and decrement tokens.
+ *
+ * Naming a variable only moves it into V0, so within a run the variable
+ * in each of V0, V1 and V2 is known when compiling, except for the
+ * slots held when the run starts. Operations are compiled to
+ * instructions over the registers: the 22 variables, Vt, and V0-V2 at
+ * the start of the run. Numbers are then folded through the registers,
+ * and stores that are overwritten before being read are removed.
+ *
+ * The first token of a run gets the code EX_IR, and jmp is the index of
+ * the run. A jump into the middle of a run executes the tokens.
+ * Adding a string returns to the interpreter at that token.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+static var *ir_var(q_env *e,var **v,int r) {
+	return r<VARS? &e->va[r] : r==IR_VT? &e->vt : v[r-IR_V0];
+}
+
+// V0 = V2 op V1, as in q_exec. Returns -1 when strings are added.
+static int ir_arith(int o,var *v0,var *v2,var *v1) {
+	double f;
+	long i;
+	if(v1->type==STR || v2->type==STR) return o==IR_ADD? -1 : 0;
+	if(v1->type==VOID || v2->type==VOID) return 0;
+	if(v1->type==INT && v2->type==INT) {
+		switch(o) {
+			case IR_ADD:i = v2->i+v1->i;break;
+			case IR_SUB:i = v2->i-v1->i;break;
+			case IR_MUL:i = v2->i*v1->i;break;
+			case IR_DIV:i = v2->i/v1->i;break;
+			default:i = v2->i%v1->i;break;
+		}
+		var_free(v0);
+		v0->i = i,v0->type = INT;
+	} else {
+		double a = v2->type==INT? (double)v2->i : v2->f;
+		double b = v1->type==INT? (double)v1->i : v1->f;
+		switch(o) {
+			case IR_ADD:a = a+b;break;
+			case IR_SUB:a = a-b;break;
+			case IR_MUL:a = a*b;break;
+			case IR_DIV:a = a/b;break;
+			default:a = modf(a/b,&f);break;
+		}
+		var_free(v0);
+		v0->f = a,v0->type = FLOAT;
+	}
+	return 0;
+}
+
+// Number of tokens of the operation at i, or 0 if it can not be compiled:
+static int ir_token(q_env *e,int i) {
+	q_token *t = &e->tok[i];
+	if(t->code==EX_INC_CMP_IF || t->code==EX_VAR_OUTPUT) return 0; // Leave to fused operators
+	switch(t->op) {
+		case OP_VAR:case OP_NUM:
+			return 1;
+		case OP_ADD:case OP_SUB:case OP_MUL:case OP_DIV:case OP_MOD:
+		case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+			if(!t->arg) return 1;
+			return i+1<e->tok_len && e->tok[i+1].op==OP_NUM? 2 : 0;
+		case OP_SET:case OP_INC:case OP_DEC:
+			return 1;
+	}
+	return 0;
+}
+
+static int ir_const(q_env *e,var *v) {
+	e->cst = (var *)realloc(e->cst,sizeof(var)*(e->cst_len+1));
+	e->cst[e->cst_len] = *v;
+	return e->cst_len++;
+}
+
+static void ir_add(q_env *e,int *cap,int o,int i,int *v,int d,int a,int b) {
+	if(e->ir_len==*cap) e->ir = (q_ir *)realloc(e->ir,sizeof(q_ir)*(*cap *= 2));
+	e->ir[e->ir_len++] = (q_ir){ op: o, tok: i, d: d, a: a, b: b, v: { v[0],v[1],v[2] } };
+}
+
+/* Fold numbers through the registers; k is the constant held by each
+ * register, or -1. Writing through V0-V2 of the start of the run may
+ * change any variable. */
+static int ir_fold(q_env *e,q_ir *p,int n) {
+	int i,j,r = 0,k[IR_REGS];
+	var v;
+	for(i=0; i<IR_REGS; ++i) k[i] = -1;
+	for(; n--; ++p) {
+		if(p->op==IR_SET && p->a<IR_V0 && k[p->a]>=0) p->op = IR_NUM,p->a = k[p->a];
+		else if(p->op>=IR_ADD && p->op<=IR_MOD && p->a<IR_V0 && p->b<IR_V0 && k[p->a]>=0 && k[p->b]>=0) {
+			var *a = &e->cst[k[p->a]],*b = &e->cst[k[p->b]];
+			if((p->op==IR_DIV || p->op==IR_MOD) && b->type==INT && (b->i==0 || b->i==-1)) goto ir_clear;
+			v = (var){ index: 0, type: VOID, i: 0 };
+			ir_arith(p->op,&v,a,b);
+			p->op = IR_NUM,p->a = ir_const(e,&v),++r;
+		} else if((p->op==IR_INC || p->op==IR_DEC) && p->d<IR_V0 && k[p->d]>=0) {
+			v = e->cst[k[p->d]];
+			if(v.type==INT) v.i += p->op==IR_INC? 1 : -1;
+			else v.f += p->op==IR_INC? 1.0 : -1.0;
+			p->op = IR_NUM,p->a = ir_const(e,&v),++r;
+		}
+ir_clear:
+		if(p->d>=IR_V0) {
+			for(j=0; j<VARS; ++j) k[j] = -1;
+		} else k[p->d] = p->op==IR_NUM? p->a : -1;
+	}
+	return r;
+}
+
+/* Remove numbers and sets to a variable or Vt that is set again before
+ * it is read. Reading V0-V2 of the start of the run may read any variable. */
+static int ir_dead(q_ir *p,int n) {
+	int i,j,r = 0,live[IR_REGS];
+	for(i=0; i<IR_REGS; ++i) live[i] = 1; // All registers are read after the run
+	for(i=n-1; i>=0; --i) {
+		q_ir *q = &p[i];
+		if((q->op==IR_NUM || (q->op==IR_SET && q->a!=q->d)) && q->d<IR_V0) {
+			if(!live[q->d]) {
+				q->op = IR_NOP,++r;
+				continue;
+			}
+			live[q->d] = 0;
+		}
+		if(q->op==IR_NUM) continue;
+		if(q->op!=IR_SET) live[q->d] = 1;
+		if(q->op>=IR_SET && q->op<=IR_MOD) {
+			live[q->a] = 1;
+			if(q->op!=IR_SET) live[q->b] = 1;
+			if(q->a>=IR_V0 || q->b>=IR_V0)
+				for(j=0; j<VARS; ++j) live[j] = 1;
+		}
+		if(q->d>=IR_V0)
+			for(j=0; j<VARS; ++j) live[j] = 1;
+	}
+	return r;
+}
+
+// Compile the run of tokens from s to l:
+static void ir_run(q_env *e,int *cap,int *irb_cap,int s,int l) {
+	q_token *t;
+	q_irb *b;
+	int i,j,n,o,v[3] = { IR_V0,IR_V0+1,IR_V0+2 },r0,r1,r2,k = e->ir_len;
+	for(i=s; i<=l; i+=n) {
+		t = &e->tok[i],o = t->op,n = ir_token(e,i);
+		if(o==OP_VAR) {
+			v[2] = v[1],v[1] = v[0],v[0] = t->arg;
+			continue;
+		}
+		r0 = v[0],r1 = v[1],r2 = v[2];
+		if(n==2) { // Constant operand, set Vt
+			ir_add(e,cap,IR_NUM,i,v,IR_VT,e->tok[i+1].arg,0);
+			if(o&0x2000) r0 = IR_VT;
+			else if(o&0x10000) r2 = IR_VT;
+			else r1 = IR_VT,r2 = v[1];
+		}
+		switch(o) {
+			case OP_NUM:
+				ir_add(e,cap,IR_NUM,i,v,IR_VT,t->arg,0);
+				ir_add(e,cap,IR_NUM,i,v,r0,t->arg,0);
+				break;
+			case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+				r2 = r0;
+			case OP_ADD:case OP_SUB:case OP_MUL:case OP_DIV:case OP_MOD:
+				switch(o&0xff) {
+					case 1:o = IR_ADD;break;
+					case 2:o = IR_SUB;break;
+					case 3:o = IR_MUL;break;
+					case 4:o = IR_DIV;break;
+					default:o = IR_MOD;break;
+				}
+				ir_add(e,cap,o,i,v,r0,r2,r1);
+				break;
+			case OP_SET:ir_add(e,cap,IR_SET,i,v,r0,r1,0);break;
+			case OP_INC:ir_add(e,cap,IR_INC,i,v,r0,0,0);break;
+			case OP_DEC:ir_add(e,cap,IR_DEC,i,v,r0,0,0);break;
+		}
+	}
+	n = e->ir_len-k;
+	e->ir_fold += ir_fold(e,&e->ir[k],n);
+	e->ir_dead += ir_dead(&e->ir[k],n);
+	for(i=k,j=k; i<e->ir_len; ++i) // Remove dead instructions
+		if(e->ir[i].op!=IR_NOP) e->ir[j++] = e->ir[i];
+	e->ir_len = j;
+
+	if(e->irb_len==*irb_cap) e->irb = (q_irb *)realloc(e->irb,sizeof(q_irb)*(*irb_cap *= 2));
+	b = &e->irb[e->irb_len];
+	*b = (q_irb){ tok: s, end: l, ir: k, ir_len: j-k, v: { v[0],v[1],v[2] } };
+	e->tok[s].code = EX_IR;
+	e->tok[s].jmp = e->irb_len++;
+}
+
+int q_ir_compile(q_env *e) {
+	int i,j,n,cap = 16,irb_cap = 8;
+	e->ir = (q_ir *)malloc(sizeof(q_ir)*cap);
+	e->irb = (q_irb *)malloc(sizeof(q_irb)*irb_cap);
+	e->ir_len = e->irb_len = e->ir_fold = e->ir_dead = 0;
+	for(i=0; i<e->tok_len; i=j+1) {
+		for(j=i; j<e->tok_len && (n=ir_token(e,j)); j+=n);
+		if(j-i>=3) ir_run(e,&cap,&irb_cap,i,j-1);
+	}
+if(verbose) q_outv(0,"%s: %d, %s: %d, %s: %d, %s: %d" STR_NL,_("Compiled runs"),e->irb_len,
+	_("instructions"),e->ir_len,_("folded"),e->ir_fold,_("removed"),e->ir_dead);
+	return e->irb_len;
+}
+
+int q_ir_exec(q_env *e,q_irb *b) {
+	var *v[3] = { e->v0,e->v1,e->v2 },*d;
+	q_ir *p = &e->ir[b->ir],*p1 = p+b->ir_len;
+	for(; p<p1; ++p) {
+		d = ir_var(e,v,p->d);
+		switch(p->op) {
+			case IR_NUM:var_set(d,&e->cst[p->a]);break;
+			case IR_SET:var_set(d,ir_var(e,v,p->a));break;
+			case IR_INC:
+				     if(d->type==INT)   ++d->i;
+				else if(d->type==FLOAT) ++d->f;
+				break;
+			case IR_DEC:
+				     if(d->type==INT)   --d->i;
+				else if(d->type==FLOAT) --d->f;
+				break;
+			default:
+				if(ir_arith(p->op,d,ir_var(e,v,p->a),ir_var(e,v,p->b))<0) {
+					e->v0 = ir_var(e,v,p->v[0]);
+					e->v1 = ir_var(e,v,p->v[1]);
+					e->v2 = ir_var(e,v,p->v[2]);
+					return p->tok-1;
+				}
+		}
+	}
+	e->v0 = ir_var(e,v,b->v[0]);
+	e->v1 = ir_var(e,v,b->v[1]);
+	e->v2 = ir_var(e,v,b->v[2]);
+	return b->end;
+}
@@ -0,0 +1,511 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Template JIT for hot loops, x86-64 Linux
+ *
+ * OP_LOOP counts back-edges per block. When a block gets hot and
+ * every token in it is an integer or float operation, it is compiled
+ * to native code, one template per token. V0, V1 and V2 are kept in
+ * registers and rotated by OP_VAR, the same way as in q_exec.
+ *
+ * Each template tests the types of its variables first, and if they
+ * are not handled, or would free a string, it returns to q_exec with
+ * the index of the token before, so the interpreter executes it.
+ * Reaching the end of the block also returns, so q_exec runs the ].
+ *
+ * Registers:
+ *  rbx  V0        r12  V1        r13  V2
+ *  r14  e->va     r15  e         rbp  e->b0
+ *  rdi, rsi, r8   V0, V1, V2 of the current token, after constants
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "q.h"
+#include "var.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+
+#define JIT_HOT             64    // Back-edges before compiling a block
+
+enum { // Registers
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8 = 8, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+enum { // Condition codes
+	JB = 0x2, JE = 0x4, JNE = 0x5, JA = 0x7, JL = 0xC, JGE = 0xD, JLE = 0xE, JG = 0xF
+};
+
+#define P0                  RDI
+#define P1                  RSI
+#define P2                  R8
+
+#define V_TYPE              offsetof(var,type)
+#define V_VAL               offsetof(var,i)
+#define E_VT                offsetof(q_env,vt)
+#define B_EXPR              offsetof(q_block,expr)
+
+typedef int (*jit_fn)(q_env *e);
+
+typedef struct jit_map jit_map;
+
+struct jit_map {
+	void *p;
+	size_t len;
+	jit_map *next;
+};
+
+struct q_jit {
+	int *hot;      // Back-edges per block, -1 if block can not be compiled
+	jit_fn *fn;    // Compiled code per block
+	jit_map *map;  // Executable memory
+};
+
+typedef struct jit_fix {
+	int at;        // Position of rel32
+	int tok;       // Token to jump to
+	int exit;      // Return to interpreter at token
+} jit_fix;
+
+typedef struct jit_buf {
+	unsigned char *p;
+	int len;
+	int cap;
+	jit_fix *fix;
+	int fix_len;
+	int fix_cap;
+} jit_buf;
+
+static void jit_byte(jit_buf *b,int c) {
+	if(b->len==b->cap) b->p = (unsigned char *)realloc(b->p,b->cap *= 2);
+	b->p[b->len++] = (unsigned char)c;
+}
+
+static void jit_int(jit_buf *b,int n) {
+	jit_byte(b,n),jit_byte(b,n>>8),jit_byte(b,n>>16),jit_byte(b,n>>24);
+}
+
+static void jit_long(jit_buf *b,long n) {
+	jit_int(b,(int)n),jit_int(b,(int)(n>>32));
+}
+
+static void jit_op(jit_buf *b,int w,int op,int reg,int rm) {
+	int rex = 0x40|(w? 8 : 0)|(reg&8? 4 : 0)|(rm&8? 1 : 0);
+	if(rex!=0x40) jit_byte(b,rex);
+	if(op>0xff) jit_byte(b,op>>8);
+	jit_byte(b,op);
+}
+
+// Register to register: op reg,rm
+static void jit_rr(jit_buf *b,int w,int op,int reg,int rm) {
+	jit_op(b,w,op,reg,rm);
+	jit_byte(b,0xC0|(reg&7)<<3|(rm&7));
+}
+
+// Register and memory: op reg,[base+d]
+static void jit_mem(jit_buf *b,int w,int op,int reg,int base,int d) {
+	jit_op(b,w,op,reg,base);
+	jit_byte(b,0x80|(reg&7)<<3|(base&7));
+	if((base&7)==RSP) jit_byte(b,0x24);
+	jit_int(b,d);
+}
+
+// Scalar double: op xmm,[base+d]
+static void jit_sd(jit_buf *b,int op,int xmm,int base,int d) {
+	jit_byte(b,0xF2);
+	jit_mem(b,0,0x0F00|op,xmm,base,d);
+}
+
+static void jit_type(jit_buf *b,int base,int t) { // mov byte [base+type],t
+	jit_mem(b,0,0xC6,0,base,V_TYPE);
+	jit_byte(b,t);
+}
+
+static void jit_imm(jit_buf *b,int r,long n) { // mov r,n
+	jit_byte(b,0x48|(r&8? 1 : 0));
+	jit_byte(b,0xB8|(r&7));
+	jit_long(b,n);
+}
+
+// Jumps to a token, or to an exit, are resolved when all tokens are compiled:
+static void jit_fix_add(jit_buf *b,int tok,int exit) {
+	if(b->fix_len==b->fix_cap)
+		b->fix = (jit_fix *)realloc(b->fix,sizeof(jit_fix)*(b->fix_cap *= 2));
+	b->fix[b->fix_len++] = (jit_fix){ at: b->len, tok: tok, exit: exit };
+	jit_int(b,0);
+}
+
+static void jit_jcc(jit_buf *b,int cc,int tok,int exit) {
+	jit_byte(b,0x0F),jit_byte(b,0x80|cc);
+	jit_fix_add(b,tok,exit);
+}
+
+static void jit_jmp(jit_buf *b,int tok,int exit) {
+	jit_byte(b,0xE9);
+	jit_fix_add(b,tok,exit);
+}
+
+// Jumps within a template, returns position of rel32 for jit_here:
+static int jit_jcc_local(jit_buf *b,int cc) {
+	if(cc) jit_byte(b,0x0F),jit_byte(b,0x80|cc);
+	else jit_byte(b,0xE9);
+	jit_int(b,0);
+	return b->len-4;
+}
+
+static void jit_here(jit_buf *b,int at) {
+	int d = b->len-(at+4);
+	memcpy(&b->p[at],&d,4);
+}
+
+// Exit on type of variable at [base+d]: cmp byte [base+d+type],t; jcc exit
+static void jit_guard(jit_buf *b,int base,int d,int t,int cc,int i) {
+	jit_mem(b,0,0x80,7,base,d+V_TYPE);
+	jit_byte(b,t);
+	jit_jcc(b,cc,i,1);
+}
+
+// V0 = V2 op V1
+static void jit_arith(jit_buf *b,int o,int i) {
+	int f,n;
+	jit_guard(b,P0,0,STR,JE,i);
+	jit_mem(b,0,0x0FB6,RAX,P1,V_TYPE);       // movzx eax,byte [P1+type]
+	jit_mem(b,0,0x0FB6,RCX,P2,V_TYPE);       // movzx ecx,byte [P2+type]
+	jit_rr(b,0,0x39,RCX,RAX);                // cmp eax,ecx
+	jit_jcc(b,JNE,i,1);
+	jit_rr(b,0,0x83,7,RAX),jit_byte(b,INT);  // cmp eax,INT
+	f = jit_jcc_local(b,JNE);
+	jit_mem(b,1,0x8B,RAX,P2,V_VAL);          // mov rax,[P2]
+	switch(o) {
+		case OP_ADD:jit_mem(b,1,0x03,RAX,P1,V_VAL);break;
+		case OP_SUB:jit_mem(b,1,0x2B,RAX,P1,V_VAL);break;
+		case OP_MUL:jit_mem(b,1,0x0FAF,RAX,P1,V_VAL);break;
+		case OP_DIV:
+		case OP_MOD:
+			jit_mem(b,1,0x8B,RCX,P1,V_VAL);       // mov rcx,[P1]
+			jit_byte(b,0x48),jit_byte(b,0x99);    // cqo
+			jit_rr(b,1,0xF7,7,RCX);               // idiv rcx
+			if(o==OP_MOD) jit_rr(b,1,0x89,RDX,RAX);
+			break;
+	}
+	jit_mem(b,1,0x89,RAX,P0,V_VAL);
+	jit_type(b,P0,INT);
+	n = jit_jcc_local(b,0);
+	jit_here(b,f);
+	jit_rr(b,0,0x83,7,RAX),jit_byte(b,FLOAT);
+	jit_jcc(b,JNE,i,1);
+	if(o==OP_MOD) jit_jmp(b,i,1); // Float modulo is left to the interpreter
+	else {
+		jit_sd(b,0x10,0,P2,V_VAL);              // movsd xmm0,[P2]
+		jit_sd(b,o==OP_ADD? 0x58 : o==OP_SUB? 0x5C : o==OP_MUL? 0x59 : 0x5E,0,P1,V_VAL);
+		jit_sd(b,0x11,0,P0,V_VAL);
+		jit_type(b,P0,FLOAT);
+	}
+	jit_here(b,n);
+}
+
+// b0->expr = b0->expr==-1? a : b0->expr && a
+static void jit_expr(jit_buf *b) {
+	static const unsigned char c[] = {
+		0x83,0xF9,0xFF,  // cmp ecx,-1
+		0x74,0x06,       // je set
+		0x85,0xC9,       // test ecx,ecx
+		0x75,0x02,       // jne set
+		0x31,0xC0,       // xor eax,eax
+	};
+	int i;
+	jit_mem(b,0,0x8B,RCX,RBP,B_EXPR);
+	for(i=0; i<(int)sizeof(c); ++i) jit_byte(b,c[i]);
+	jit_mem(b,0,0x89,RAX,RBP,B_EXPR);
+}
+
+static void jit_exit(jit_buf *b,int pos) {
+	jit_byte(b,0xB8),jit_int(b,pos);         // mov eax,pos
+	jit_mem(b,1,0x89,RBX,R15,offsetof(q_env,v0));
+	jit_mem(b,1,0x89,R12,R15,offsetof(q_env,v1));
+	jit_mem(b,1,0x89,R13,R15,offsetof(q_env,v2));
+	jit_byte(b,0x41),jit_byte(b,0x5F);       // pop r15
+	jit_byte(b,0x41),jit_byte(b,0x5E);       // pop r14
+	jit_byte(b,0x41),jit_byte(b,0x5D);       // pop r13
+	jit_byte(b,0x41),jit_byte(b,0x5C);       // pop r12
+	jit_byte(b,0x5D);                        // pop rbp
+	jit_byte(b,0x5B);                        // pop rbx
+	jit_byte(b,0xC3);                        // ret
+}
+
+// Compile tokens h+1 to r-1, where h is the [ and r the ] of the block:
+static jit_fn jit_compile(q_jit *j,q_env *e,int h) {
+	q_token *t,*t1;
+	var *c;
+	jit_buf b;
+	jit_fn fn = NULL;
+	jit_map *m;
+	int i,k,o,r = e->tok[h].jmp,*lab,*ext;
+	size_t l;
+
+	if(e->tok[h].op!=OP_LBLOCK || e->tok[r].op!=OP_RBLOCK || e->b0->expr_state!=EXPR_AND) return NULL;
+	for(i=h+1; i<r; ++i) { // Test that all tokens can be compiled
+		t = &e->tok[i];
+		switch(t->op) {
+			case OP_ADD:case OP_SUB:case OP_MUL:case OP_DIV:case OP_MOD:
+			case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+			case OP_IS:case OP_NIS:case OP_EQ:case OP_NEQ:
+			case OP_LT:case OP_GT:case OP_LTEQ:case OP_GTEQ:
+			case OP_SET:case OP_INC:case OP_DEC:case OP_NUM:case OP_VAR:
+			case OP_LOOP:case OP_COPEN:case OP_CCLOSE:break;
+			case OP_IF:case OP_NIF:case OP_ELSE:
+				if(t->jmp<h || t->jmp>=r) return NULL;
+				break;
+			default:return NULL;
+		}
+		if((t->op&0xE000) && t->arg) {
+			if(e->tok[++i].op!=OP_NUM) return NULL;
+		}
+	}
+
+	b = (jit_buf){ p: malloc(256), len: 0, cap: 256, fix: malloc(sizeof(jit_fix)*16), fix_len: 0, fix_cap: 16 };
+	lab = (int *)malloc(sizeof(int)*(r-h+1)*2),ext = &lab[r-h+1];
+	for(i=0; i<=r-h; ++i) lab[i] = ext[i] = -1;
+
+	jit_byte(&b,0x53);                                // push rbx
+	jit_byte(&b,0x55);                                // push rbp
+	jit_byte(&b,0x41),jit_byte(&b,0x54);              // push r12
+	jit_byte(&b,0x41),jit_byte(&b,0x55);              // push r13
+	jit_byte(&b,0x41),jit_byte(&b,0x56);              // push r14
+	jit_byte(&b,0x41),jit_byte(&b,0x57);              // push r15
+	jit_rr(&b,1,0x89,RDI,R15);                        // mov r15,rdi
+	jit_mem(&b,1,0x8B,RBX,R15,offsetof(q_env,v0));
+	jit_mem(&b,1,0x8B,R12,R15,offsetof(q_env,v1));
+	jit_mem(&b,1,0x8B,R13,R15,offsetof(q_env,v2));
+	jit_mem(&b,1,0x8B,R14,R15,offsetof(q_env,va));
+	jit_mem(&b,1,0x8B,RBP,R15,offsetof(q_env,b0));
+
+	for(i=h+1; i<r; ++i) {
+		t = &e->tok[i],o = t->op;
+		lab[i-h] = b.len;
+		if(o==OP_VAR) {
+			jit_rr(&b,1,0x89,R12,R13);
+			jit_rr(&b,1,0x89,RBX,R12);
+			jit_mem(&b,1,0x8D,RBX,R14,t->arg*sizeof(var)); // lea rbx,[va+index]
+			continue;
+		}
+		jit_rr(&b,1,0x89,RBX,P0);
+		jit_rr(&b,1,0x89,R12,P1);
+		jit_rr(&b,1,0x89,R13,P2);
+		if((o&0xE000) && t->arg) { // Constant operand, set Vt
+			t1 = &e->tok[++i];
+			c = &e->cst[t1->arg];
+			jit_guard(&b,R15,E_VT,STR,JE,i-1);
+			jit_imm(&b,RAX,c->i);
+			jit_mem(&b,1,0x89,RAX,R15,E_VT+V_VAL);
+			jit_mem(&b,0,0xC6,0,R15,E_VT+V_TYPE),jit_byte(&b,c->type);
+			if(o&0x2000) jit_mem(&b,1,0x8D,P0,R15,E_VT);
+			else if(o&0x10000) jit_mem(&b,1,0x8D,P2,R15,E_VT);
+			else {
+				jit_mem(&b,1,0x8D,P1,R15,E_VT);
+				jit_rr(&b,1,0x89,R12,P2);
+			}
+			k = i-1;
+		} else k = i;
+
+		switch(o) {
+			case OP_ADD2:case OP_SUB2:case OP_MUL2:case OP_DIV2:case OP_MOD2:
+				jit_rr(&b,1,0x89,P0,P2);
+				o = o==OP_ADD2? OP_ADD : o==OP_SUB2? OP_SUB : o==OP_MUL2? OP_MUL : o==OP_DIV2? OP_DIV : OP_MOD;
+			case OP_ADD:case OP_SUB:case OP_MUL:case OP_DIV:case OP_MOD:
+				jit_arith(&b,o,k);
+				break;
+
+			case OP_EQ:case OP_NEQ:case OP_LT:case OP_GT:case OP_LTEQ:case OP_GTEQ:
+				jit_guard(&b,P0,0,INT,JNE,k);
+				jit_guard(&b,P1,0,INT,JNE,k);
+				jit_mem(&b,1,0x8B,RAX,P0,V_VAL);
+				jit_mem(&b,1,0x2B,RAX,P1,V_VAL);
+				jit_rr(&b,0,0x85,RAX,RAX);                   // test eax,eax, as var_cmp returns int
+				jit_rr(&b,0,0x0F90|(o==OP_EQ? JE : o==OP_NEQ? JNE : o==OP_LT? JL :
+				                     o==OP_GT? JG : o==OP_LTEQ? JLE : JGE),0,RAX);
+				jit_rr(&b,0,0x0FB6,RAX,RAX);                 // movzx eax,al
+				jit_expr(&b);
+				break;
+
+			case OP_IS:case OP_NIS:
+				jit_guard(&b,P0,0,INT,JNE,k);
+				jit_mem(&b,1,0x83,7,P0,V_VAL),jit_byte(&b,0);
+				jit_rr(&b,0,0x0F90|(o==OP_IS? JNE : JE),0,RAX);
+				jit_rr(&b,0,0x0FB6,RAX,RAX);
+				jit_expr(&b);
+				break;
+
+			case OP_NIF:
+			case OP_IF:
+				jit_mem(&b,0,0x8B,RAX,RBP,B_EXPR);
+				if(o==OP_NIF) {
+					jit_rr(&b,0,0x85,RAX,RAX);
+					jit_rr(&b,0,0x0F90|JE,0,RAX);
+					jit_rr(&b,0,0x0FB6,RAX,RAX);
+				}
+				jit_mem(&b,0,0xC7,0,RBP,B_EXPR),jit_int(&b,-1);
+				jit_rr(&b,0,0x85,RAX,RAX);
+				jit_jcc(&b,JE,t->jmp+1,0);
+				break;
+
+			case OP_ELSE:
+				jit_jmp(&b,t->jmp+1,0);
+				break;
+
+			case OP_LOOP:
+				jit_mem(&b,0,0xC7,0,RBP,B_EXPR),jit_int(&b,-1);
+				jit_jmp(&b,h+1,0);
+				break;
+
+			case OP_SET:
+			{
+				int n;
+				jit_rr(&b,1,0x39,P1,P0);                     // cmp P0,P1
+				n = jit_jcc_local(&b,JE);
+				jit_guard(&b,P0,0,STR,JE,k);
+				jit_mem(&b,0,0x0FB6,RAX,P1,V_TYPE);
+				jit_rr(&b,0,0x83,7,RAX),jit_byte(&b,INT);
+				jit_jcc(&b,JB,k,1);
+				jit_rr(&b,0,0x83,7,RAX),jit_byte(&b,FLOAT);
+				jit_jcc(&b,JA,k,1);
+				jit_mem(&b,1,0x8B,RCX,P1,V_VAL);
+				jit_mem(&b,1,0x89,RCX,P0,V_VAL);
+				jit_mem(&b,0,0x88,RAX,P0,V_TYPE);          // mov [P0+type],al
+				jit_here(&b,n);
+				break;
+			}
+
+			case OP_INC:
+			case OP_DEC:
+			{
+				int n,f;
+				jit_mem(&b,0,0x80,7,P0,V_TYPE),jit_byte(&b,INT);
+				f = jit_jcc_local(&b,JNE);
+				jit_mem(&b,1,0xFF,o==OP_INC? 0 : 1,P0,V_VAL);
+				n = jit_jcc_local(&b,0);
+				jit_here(&b,f);
+				jit_mem(&b,0,0x80,7,P0,V_TYPE),jit_byte(&b,FLOAT);
+				f = jit_jcc_local(&b,JNE);
+				jit_sd(&b,0x10,0,P0,V_VAL);
+				jit_imm(&b,RAX,0x3FF0000000000000L);        // 1.0
+				jit_byte(&b,0x66),jit_rr(&b,1,0x0F6E,1,RAX); // movq xmm1,rax
+				jit_byte(&b,0xF2),jit_rr(&b,0,o==OP_INC? 0x0F58 : 0x0F5C,0,1);
+				jit_sd(&b,0x11,0,P0,V_VAL);
+				jit_here(&b,f);
+				jit_here(&b,n);
+				break;
+			}
+
+			case OP_NUM:
+				c = &e->cst[t->arg];
+				jit_guard(&b,R15,E_VT,STR,JE,k);
+				jit_guard(&b,P0,0,STR,JE,k);
+				jit_imm(&b,RAX,c->i);
+				jit_mem(&b,1,0x89,RAX,R15,E_VT+V_VAL);
+				jit_mem(&b,0,0xC6,0,R15,E_VT+V_TYPE),jit_byte(&b,c->type);
+				jit_mem(&b,1,0x89,RAX,P0,V_VAL);
+				jit_type(&b,P0,c->type);
+				break;
+		}
+	}
+	jit_jmp(&b,r,0);
+
+	for(i=0; i<b.fix_len; ++i) { // Resolve jumps, and write exits to interpreter
+		jit_fix *f = &b.fix[i];
+		int *p = f->exit || f->tok==r? &ext[f->tok-h] : &lab[f->tok-h];
+		if(*p==-1) {
+			if(p==&lab[f->tok-h]) goto jit_err; // Jump into a constant operand
+			*p = b.len;
+			jit_exit(&b,f->tok-1);
+		}
+		k = *p-(f->at+4);
+		memcpy(&b.p[f->at],&k,4);
+	}
+
+	l = (b.len+4095)&~(size_t)4095;
+	if(!(m=(jit_map *)malloc(sizeof(jit_map)))) goto jit_err;
+	m->p = mmap(NULL,l,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if(m->p==MAP_FAILED) {
+		free(m);
+		goto jit_err;
+	}
+	memcpy(m->p,b.p,b.len);
+	if(mprotect(m->p,l,PROT_READ|PROT_EXEC)!=0) { // Executable mappings denied, the block stays interpreted
+		munmap(m->p,l);
+		free(m);
+		goto jit_err;
+	}
+	m->len = l,m->next = j->map,j->map = m;
+	fn = (jit_fn)m->p;
+if(verbose) q_outv(0,"%s [%ld]: %d %s, %d bytes" STR_NL,_("Compiled block"),e->tok[h].pos,r-h-1,_("tokens"),b.len);
+
+jit_err:
+	free(lab);
+	free(b.fix);
+	free(b.p);
+	return fn;
+}
+
+int q_jit_loop(q_env *e) {
+	q_jit *j = e->jit;
+	int h = e->b0->pos;
+	if(debug || h<0) return e->pos;
+	if(!j) {
+		j = e->jit = (q_jit *)malloc(sizeof(q_jit));
+		j->hot = (int *)calloc(e->tok_len,sizeof(int));
+		j->fn = (jit_fn *)calloc(e->tok_len,sizeof(jit_fn));
+		j->map = NULL;
+	}
+	if(!j->fn[h]) {
+		if(j->hot[h]<0 || ++j->hot[h]<JIT_HOT) return e->pos;
+		if(!(j->fn[h]=jit_compile(j,e,h))) {
+			j->hot[h] = -1;
+			return e->pos;
+		}
+	}
+	return j->fn[h](e);
+}
+
+void q_jit_free(q_env *e) {
+	q_jit *j = e->jit;
+	jit_map *m;
+	if(!j) return;
+	while((m=j->map)) {
+		j->map = m->next;
+		munmap(m->p,m->len);
+		free(m);
+	}
+	free(j->hot);
+	free(j->fn);
+	free(j);
+	e->jit = NULL;
+}
+
+#else /* Not x86-64 Linux, the interpreter is used */
+
+int q_jit_loop(q_env *e) {
+	return e->pos;
+}
+
+void q_jit_free(q_env *e) {
+}
+
+#endif
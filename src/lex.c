@@ -0,0 +1,266 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+#define LEX_DOUT_MAX 0x40000000 // Longest direct text of one token, longer text is split
+#define LEX_TOK_CAP  65536      // Largest initial token capacity, otherwise a quarter of the source length
+
+static q_token *lex_token(q_token *tok,int *n,int *cap) {
+	if(*n==*cap) {
+		*cap *= 2;
+		tok = (q_token *)realloc(tok,sizeof(q_token)*(*cap));
+	}
+	return tok;
+}
+
+static var *lex_const(var *cst,int *n,int *cap) {
+	if(*n==*cap) {
+		*cap *= 2;
+		cst = (var *)realloc(cst,sizeof(var)*(*cap));
+	}
+	if(cst) cst[*n] = (var){ index: 0, type: VOID, i: 0 };
+	return cst;
+}
+
+static q_seg *lex_seg(q_seg *seg,int *n,int *cap) {
+	if(*n==*cap) {
+		*cap *= 2;
+		seg = (q_seg *)realloc(seg,sizeof(q_seg)*(*cap));
+	}
+	return seg;
+}
+
+// Long strings are views of the source, strings are cut at 2GB:
+static str *lex_str(q_env *e,const utf8_t *p,q_pos l) {
+	if(l>=INT_MAX) l = INT_MAX-1;
+	if(l>=STR_INLINE_LEN && e->src_s) return str_intern_view(e->src_s,p-e->src_s->data,l);
+	return str_intern(p,l);
+}
+
+// Offset of the first a, b or zero in p, or n if none:
+static q_pos lex_scan(const utf8_t *p,q_pos n,int a,int b) {
+	q_pos i = 0;
+	int c;
+#ifdef __SSE2__
+	__m128i va = _mm_set1_epi8((char)a),vb = _mm_set1_epi8((char)b),vz = _mm_setzero_si128(),x;
+	for(; i+16<=n; i+=16) {
+		x = _mm_loadu_si128((const __m128i *)&p[i]);
+		if((c=_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x,va),_mm_cmpeq_epi8(x,vb)),_mm_cmpeq_epi8(x,vz)))))
+			return i+__builtin_ctz(c);
+	}
+#endif
+	for(; i<n && (c=p[i])!=a && c!=b && c; ++i);
+	return i;
+}
+
+int q_code(int o) {
+	int i;
+	for(i=1; i<EX_LEN; ++i)
+		if(ex_op[i]==o) return i;
+	return EX_NONE;
+}
+
+/* Resolve jumps by scanning backwards, keeping for each open block
+ * the index of its close and of the next else-operator or close. */
+static void lex_jump(q_token *tok,int n) {
+	int i,o,d = 0;
+	int *b = (int *)malloc(sizeof(int)*(n+1)*2);
+	b[0] = b[1] = n-1; // End of script
+	for(i=n-1; i>=0; --i) {
+		o = tok[i].op;
+		if(o==OP_RBLOCK) ++d,b[d*2] = i-1,b[d*2+1] = i-1;
+		else if(o==OP_LBLOCK) {
+			tok[i].jmp = b[d*2]+1<n? b[d*2]+1 : n-1;
+			if(d>0) --d;
+		} else if(o==OP_ELSE) tok[i].jmp = b[d*2],b[d*2+1] = i;
+		else if(o==OP_IF || o==OP_NIF) tok[i].jmp = b[d*2+1];
+	}
+	free(b);
+}
+
+static int lex_cmp(int o) {
+	return o==OP_LT || o==OP_GT || o==OP_LTEQ || o==OP_GTEQ || o==OP_EQ || o==OP_NEQ;
+}
+
+/* Peephole pass, marking common sequences of tokens to be executed as
+ * one operator. Only the code of the first token is changed, so jumps
+ * into a sequence execute the remaining tokens one by one. */
+static void lex_fuse(q_token *tok,int n) {
+	int i,o,o1;
+	for(i=0; i+1<n; ++i) {
+		o = tok[i].op,o1 = tok[i+1].op;
+		if(o==OP_VAR) {
+			if(o1==OP_VAR) tok[i].code = i+2<n && tok[i+2].op==OP_SET? EX_VAR2_SET : EX_VAR2;
+			else if(o1==OP_OUTPUT && !tok[i+1].arg) tok[i].code = EX_VAR_OUTPUT;
+		} else if(o==OP_INC && lex_cmp(o1)) {
+			if(!tok[i+1].arg && i+2<n && tok[i+2].op==OP_IF) tok[i].code = EX_INC_CMP_IF;
+			else if(tok[i+1].arg && i+3<n && tok[i+2].op==OP_NUM && tok[i+3].op==OP_IF) tok[i].code = EX_INC_CMP_IF;
+		} else if(o==OP_IF && o1==OP_LOOP) tok[i].code = EX_IF_LOOP;
+	}
+}
+
+int q_lex(q_env *e,q_pos pos) {
+	const utf8_t *src = e->src;
+	q_pos i,j,l,a,len = e->len;
+	int n = 0,cap = (len/4<LEX_TOK_CAP? (int)(len/4) : LEX_TOK_CAP)+16,k = 0,cst_cap = 16,m = 0,seg_cap = 16,p = 0,tpl_cap = 16,b,c,o;
+	q_token *tok = (q_token *)malloc(sizeof(q_token)*cap),*t;
+	var *cst = (var *)malloc(sizeof(var)*cst_cap);
+	q_seg *seg = (q_seg *)malloc(sizeof(q_seg)*seg_cap);
+	int *tpl = (int *)malloc(sizeof(int)*tpl_cap);
+	const utf8_letter *g;
+
+	for(i=pos; i<len && (c=src[i]); ++i) {
+		if(!(o=op[c])) continue; // White space, or not a Q char
+
+		if(isunicode(c)) { // UTF-8 unicode
+			if(!(l=utf8_valid(&src[i],len-i))) continue; // Invalid bytes are skipped one at a time
+			if(l!=2 || !(g=utf8_lookup(&src[i]))->latin) { // Only letters are recognised
+				i += l-1;
+				continue;
+			}
+			if(!(tok=lex_token(tok,&n,&cap))) return -1;
+			tok[n++] = (q_token){ op: OP_VAR, pos: i, len: l, arg: g->var, jmp: -1, code: EX_VAR, type: 0 };
+			i += l-1;
+			continue;
+		}
+
+		l = 1;
+		if(o>=0x1000 && i+1<len && (a=op[src[i+1]])>=0x1000)
+			if((b=op_combine(o,a))) o = b,l = 2;
+
+		if(!(tok=lex_token(tok,&n,&cap))) return -1;
+		t = &tok[n];
+		*t = (q_token){ op: o, pos: i, len: l, arg: 0, jmp: -1, code: q_code(o), type: 0 };
+		i += l-1;
+
+		switch(o) {
+			case OP_VAR:
+				t->arg = c>='a'? l2h[c-'a'] : l2h[c-'A'];
+				break;
+
+			case OP_NUM:
+				if(!(cst=lex_const(cst,&k,&cst_cap))) return -1;
+				b = 0;
+				var_num(&cst[k],&src[i],len-i,&b);
+				if(b>0) i += b;
+				t->arg = k++;
+				break;
+
+			case OP_STR: // Strings without inserted variables are constant
+				for(++i,l=i,a=0; i<len && (c=src[i]) && c!='\''; ++i)
+					if(c=='&') {
+						if(i+2<len && src[i+1]==':' && ((c=src[i+2])=='*' ||
+							(c>='A' && c<='Z') || (c>='a' && c<='z'))) a = 1;
+						if(++i==len) break;
+					}
+				if(a) { // Compile to template of text segments, each followed by a variable
+					if(p+1==tpl_cap && !(tpl=(int *)realloc(tpl,sizeof(int)*(tpl_cap*=2)))) return -1;
+					tpl[p] = m;
+					for(j=l,a=l; j<i; ++j)
+						if(src[j]=='&') {
+							if(j+2<len && src[j+1]==':' && ((c=src[j+2])=='*' ||
+								(c>='A' && c<='Z') || (c>='a' && c<='z'))) {
+								if(!(seg=lex_seg(seg,&m,&seg_cap))) return -1;
+								seg[m++] = (q_seg){ pos: a, len: j-a, var: c=='*'? VARS : l2h[(c|0x20)-'a'] };
+								a = j+3;
+							}
+							++j;
+						}
+					if(!(seg=lex_seg(seg,&m,&seg_cap))) return -1;
+					seg[m++] = (q_seg){ pos: a, len: (i<len? i : len)-a, var: -1 };
+					t->arg = ~p++;
+				} else {
+					if(!(cst=lex_const(cst,&k,&cst_cap))) return -1;
+					cst[k].type = STR,cst[k].s = lex_str(e,&src[l],(i<len? i : len)-l);
+					t->arg = k++;
+				}
+				break;
+
+			case OP_DOUT: // Text until "<?", or to end of script
+				for(++i,l=i; (i+=lex_scan(&src[i],len-i,'<','<'))<len && (c=src[i]); ++i)
+					if(i+1<len && src[i+1]=='?') break;
+				for(; i-l>LEX_DOUT_MAX; l+=LEX_DOUT_MAX) { // Split, each token read as if after "?>"
+					t->pos = l-2,t->len = LEX_DOUT_MAX+2,t->arg = LEX_DOUT_MAX;
+					++n;
+					if(!(tok=lex_token(tok,&n,&cap))) return -1;
+					t = &tok[n],*t = tok[n-1];
+				}
+				t->pos = l-2,t->arg = i-l;
+				if(i<len && c) ++i;
+				break;
+
+			case OP_DSTR: // Text until matching "<&", unterminated strings end the script
+				for(++i,l=i,a=1; (i+=lex_scan(&src[i],len-i,'&','<'))<len && (c=src[i]); ++i) {
+					if(c=='&' && i+1<len && src[i+1]=='>') ++a,++i;
+					else if(c=='<' && i+1<len && src[i+1]=='&') {
+						if(!--a) break;
+						else ++i;
+					}
+				}
+				if(i>=len || !c) {
+					i = len;
+					continue;
+				}
+				if(!(cst=lex_const(cst,&k,&cst_cap))) return -1;
+				cst[k].type = STR,cst[k].s = lex_str(e,&src[l],i-l);
+				t->arg = k++;
+				++i;
+				break;
+
+			case OP_COPEN:
+				for(++i,a=1; i<len && (c=src[i]); ++i) {
+					if(c=='/' && i+1<len && src[i+1]=='*') ++a,++i;
+					else if(c=='*' && i+1<len && src[i+1]=='/' && !--a) break;
+				}
+				if(i<len && c) ++i;
+				else i = len-1;
+				break;
+		}
+		if(i>=len) i = len-1;
+		t->len = i-t->pos<INT_MAX? i-t->pos+1 : INT_MAX;
+		++n;
+	}
+
+	// Mark operators followed by a constant operand:
+	for(i=0; i+1<n; ++i)
+		if((tok[i].op&0xE000) && ((a=tok[i+1].op)==OP_NUM ||
+				(a==OP_STR && !(tok[i+1].len>1 && src[tok[i+1].pos+1]=='>')))) // Ignore direct output strings: '>...
+			tok[i].arg = 1;
+
+	lex_jump(tok,n);
+	if(!debug) lex_fuse(tok,n);
+
+	e->tok = tok;
+	e->tok_len = n;
+	e->cst = cst;
+	e->cst_len = k;
+	e->seg = seg;
+	e->tpl = tpl;
+	e->tpl_len = p;
+	tpl[p] = m;
+	return n;
+}
+
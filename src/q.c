@@ -22,11 +22,17 @@
  * (to compile with readline, add flags -DREADLINE -lreadline)
  */
 #include <stdlib.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "q.h"
 #include "var.h"
 #include "str.h"
@@ -59,8 +65,8 @@ Enter Q-code, type 'help' for instructions." STR_NL
   show    Show entered data" STR_NL
 
 #define ERR_FILE_IN "Could not open input file"
-
-#define op_combine(a,b) arop[((a)&0xff)*17+((b)&0xff)-18]
+#define ERR_IMAGE "Not a compiled script of this version"
+#define ERR_FLUSH "Flush mode must be line, block or full"
 
 int op[] = {
 /* .0123456789                 101-111   Number
@@ -123,285 +129,181 @@ int arop[] = {
    0,         0,         0,         0,         0,         0,         0,         OP_NOT2,   0,         0,         0,         0,         0,         0,         0,         0,         0,
 };
 
-int debug = 0;
-int verbose = 0;
-int newline = 0;
-
-static void run(char *src,int len,FILE *in,FILE *out);
-static char *file_read(const char *file,int *len);
-
-void q_outv(int nl,const char *f, ...) {
-	va_list list;
-	va_start(list,f);
-	if(newline) fputs(STR_NL,stdout);
-	fputs(ANSI_COLOR_VERBOSE,stdout);
-	vfprintf(stdout,f,list);
-	fputs(ANSI_COLOR_RESET,stdout);
-	va_end(list);
-	newline = nl;
-}
-
-void q_outd(int nl,const char *f, ...) {
-	va_list list;
-	va_start(list,f);
-	if(newline) fputs(STR_NL,stderr);
-	fputs(ANSI_COLOR_DEBUG,stderr);
-	vfprintf(stderr,f,list);
-	fputs(ANSI_COLOR_RESET,stderr);
-	va_end(list);
-	newline = nl;
-}
-
-void q_oute(int nl,const char *f, ...) {
-	va_list list;
-	va_start(list,f);
-	if(newline) fputs(STR_NL,stderr);
-	fputs(ANSI_COLOR_ERROR,stderr);
-	vfprintf(stderr,f,list);
-	fputs(ANSI_COLOR_RESET,stderr);
-	va_end(list);
-	newline = nl;
-}
-
-void q_outc(int c,FILE *out) {
-	if(c=='\t' || (c>=32 && c<=127)) {
-		fputc(c,out);
-		newline = 1;
-	} else if(c=='\n' || c==EOF) {
-		fputs(STR_NL,out);
-		newline = 0;
-	}
-}
-
-void q_out_utf8(utf8_t **p,FILE *out) {
-	utf8_t *s = *p;
-	int i = *s;
-//if(debug) q_outd(0,"q_out_utf8(len: %d)" STR_NL,utf8_len(i));
-	for(i=utf8_len(i); i--; ++s) /*printf("[0x%02X]",(int)*s);*/fputc(*s,out);
-	*p = s;
-	newline = 1;
-}
-
-int q_str_len(q_env *e,const utf8_t *p) {
-	int l,c,a;
-	var *v1;
-	for(l=0; (c=p[l]) && c!='\''; ++l)
-		if(c=='&') {
-			if(p[l+1]==':' && (c=p[l+2])) {
-				if((c=='*' || 
-					(c>='A' && c<='Z' && (a=l2h[c-'A'])>=0) ||
-					(c>='a' && c<='z' && (a=l2h[c-'a'])>=0))) {
-					if(c=='*') v1 = &e->vt;
-					else v1 = &e->va[a];
-					if(v1->type==INT) l += 22;
-					else if(v1->type==FLOAT) l += 42;
-					else if(v1->type==STR) l += v1->s->len;
-					else ++l;
-				}
-			} else ++l;
-		}
-//if(debug) q_outd(0,"q_str_len(l: %d)" STR_NL,l);
-	return l;
-}
-
-/*int q_str_match(q_env *e,const utf8_t *p) {
-	int l,n,c;
-	for(l=0,n=1; (c=p[l]); ++l) {
-		if(c=='\'') {
-			if(p[l+1]=='>') ++n,++l;
-			else if(p[l+1]==':' && p[l+2]=='>') ++b,l += 2;
-		} else if(c=='<' && p[l+1]=='\'' && !--n) return l+1;
-	}
-	return l;
-}*/
-
-void q_var_str(q_env *e,var *v,const utf8_t *p,int *len) {
-	var_free(v);
-	v->type = STR,v->s = NULL;
-	if(*p=='\'') {
-		int i,l = q_str_len(e,++p),c,a;
-		var *v1;
-		utf8_t *s = (utf8_t *)malloc(l+1);
-		for(i=0,l=0; (c=p[i]) && c!='\''; ++i) {
-			if(c=='&') {
-				if(p[i+1]==':' && (c=p[i+2])) {
-					if((c=='*' || 
-						(c>='A' && c<='Z' && (a=l2h[c-'A'])>=0) ||
-						(c>='a' && c<='z' && (a=l2h[c-'a'])>=0))) {
-						if(c=='*') v1 = &e->vt;
-						else v1 = &e->va[a];
-						if(v1->type==INT) l += sprintf((char *)&s[l],"%ld",v1->i);
-						else if(v1->type==FLOAT) l += sprintf((char *)&s[l],"%g",v1->f);
-						else if(v1->type==STR) { strcpy((char *)&s[l],(char *)str_data(v1->s));l += v1->s->len; }
-						else s[l++] = '?';
-						i += 2;
-						continue;
-					}
-				}
-				s[l++] = p[i++];
-			}
-			s[l++] = p[i];
-		}
-		s[l] = '\0';
-		v->s = str_new(s,l);
-		if(len) *len += c=='\0'? i-1 : i+1;
-//if(debug) q_outd(0,"q_var_str(l: %d, s: %s)" STR_NL,l,s);
-if(verbose) q_outv(0,"%s: " ANSI_COLOR_YELLOW "\"%s\"" STR_NL,_("Created string"),(char *)str_data(v->s));
-	}
-}
-
-void q_input(q_env *e,var *v,int l) {
-	int c,i,n,m = l;
-	char ln[81],*b;
-	if(!v) return;
-	if(m<=0) m = 1024;
-	*ln = '\0',c = '\0',b = malloc(m+1);
-	for(i=0; c!='\n'; i+=n) {
-		if(fgets(ln,81,e->in)==NULL) break;
-		n = strlen(ln);
-//if(debug) q_outd(0,"ln[n: %d]: %s" STR_NL,n,ln);
-		if(!n) break;
-		if((c=ln[n-1])=='\n' || c=='\r') { // remove '\n' & '\r'
-			if(n>1 && ((c=ln[n-2])=='\n' || c=='\r')) --n;
-			ln[--n] = '\0',c = '\n';
-		}
-//if(debug) q_outd(0,"ln[cap: %d, p: %d, n: %d]: %s" STR_NL,(int)cap,p,n,ln);
-		if(i+n>=m) {
-			m = m*2<i+n? i+n+1 : m*2;
-			if(!(b=realloc(b,m))) return;
-		}
-		strcpy(&b[i],ln);
-	}
-	if(v->type==STR && v->s) str_free(v->s);
-	v->type = STR;
-	v->s = str_new((utf8_t *)b,l<=0? m : l);
-	newline = 0;
-}
+int ex_op[] = {
+	[EX_ADD] = OP_ADD,          [EX_SUB] = OP_SUB,          [EX_MUL] = OP_MUL,          [EX_DIV] = OP_DIV,
+	[EX_MOD] = OP_MOD,          [EX_INDEX] = OP_INDEX,      [EX_OUTPUT] = OP_OUTPUT,    [EX_SET] = OP_SET,
+	[EX_IF] = OP_IF,            [EX_EQ] = OP_EQ,            [EX_NIS] = OP_NIS,          [EX_LT] = OP_LT,
+	[EX_GT] = OP_GT,            [EX_GOTO] = OP_GOTO,        [EX_CARET] = OP_CARET,      [EX_ELSE] = OP_ELSE,
+	[EX_NOT] = OP_NOT,          [EX_LEXPR] = OP_LEXPR,      [EX_REXPR] = OP_REXPR,      [EX_LBLOCK] = OP_LBLOCK,
+	[EX_RBLOCK] = OP_RBLOCK,    [EX_NUM] = OP_NUM,          [EX_STR] = OP_STR,          [EX_VAR] = OP_VAR,
+	[EX_INT] = OP_INT,          [EX_FLOAT] = OP_FLOAT,      [EX_ADD2] = OP_ADD2,        [EX_SUB2] = OP_SUB2,
+	[EX_MUL2] = OP_MUL2,        [EX_DIV2] = OP_DIV2,        [EX_MOD2] = OP_MOD2,        [EX_INC] = OP_INC,
+	[EX_DEC] = OP_DEC,          [EX_POW] = OP_POW,          [EX_SQRT] = OP_SQRT,        [EX_LSHIFT] = OP_LSHIFT,
+	[EX_RSHIFT] = OP_RSHIFT,    [EX_AND] = OP_AND,          [EX_OR] = OP_OR,            [EX_XOR] = OP_XOR,
+	[EX_LSHIFT2] = OP_LSHIFT2,  [EX_RSHIFT2] = OP_RSHIFT2,  [EX_AND2] = OP_AND2,        [EX_OR2] = OP_OR2,
+	[EX_XOR2] = OP_XOR2,        [EX_NOT2] = OP_NOT2,        [EX_ABS] = OP_ABS,          [EX_NEG] = OP_NEG,
+	[EX_FLOOR] = OP_FLOOR,      [EX_CEIL] = OP_CEIL,        [EX_INT2] = OP_INT2,        [EX_RED] = OP_RED,
+	[EX_NIF] = OP_NIF,          [EX_IS] = OP_IS,            [EX_NEQ] = OP_NEQ,          [EX_LTEQ] = OP_LTEQ,
+	[EX_GTEQ] = OP_GTEQ,        [EX_ELVIS] = OP_ELVIS,      [EX_ELVIS2] = OP_ELVIS2,    [EX_INPUT] = OP_INPUT,
+	[EX_DOUT] = OP_DOUT,        [EX_DOUTE] = OP_DOUTE,      [EX_DSTR] = OP_DSTR,        [EX_DSTRE] = OP_DSTRE,
+	[EX_POS] = OP_POS,          [EX_LOOP] = OP_LOOP,        [EX_RETURN] = OP_RETURN,    [EX_INCLUDE] = OP_INCLUDE,
+	[EX_EXEC] = OP_EXEC,        [EX_COPEN] = OP_COPEN,      [EX_CCLOSE] = OP_CCLOSE,
+	[EX_VAR2] = OP_VAR,         [EX_VAR2_SET] = OP_VAR,     [EX_VAR_OUTPUT] = OP_VAR,   [EX_INC_CMP_IF] = OP_INC,
+	[EX_IF_LOOP] = OP_IF,       [EX_ADD_II] = OP_ADD,       [EX_ADD_FF] = OP_ADD,       [EX_SUB_II] = OP_SUB,
+	[EX_SUB_FF] = OP_SUB,       [EX_MUL_II] = OP_MUL,       [EX_MUL_FF] = OP_MUL,       [EX_DIV_II] = OP_DIV,
+	[EX_DIV_FF] = OP_DIV,       [EX_MOD_II] = OP_MOD,       [EX_CMP_II] = OP_LT,
+};
 
-void q_output(q_env *e,var *v) {
-	if(v->type==VOID) fputc('?',e->out);
-	else if(v->type==INT) fprintf(e->out,"%ld",v->i);
-	else if(v->type==FLOAT) fprintf(e->out,"%g",v->f);
-	else {
-		if(v->type==STR && v->s && str_data(v->s)) {
-			utf8_t *p = str_data(v->s);
-			int c = *p;
-			if(c=='<') {
-				q_input(e,v,0);
-			} else {
-				var *v1;
-				int c0,n,a = 0;
-//if(debug) q_outd(0,"q_output(\"%s\")" STR_NL,(char *)p);
-				while((c=*p++)) {
-					if(c=='&') {
-						c0 = 0,c = *p,n = 0;
-						if(/*c=='>' || */c=='<'/* || c=='|' || c=='%'*/) c0 = c,c = p[++n];
-						if(isunicode(c)) {
-							a = utf8_decode(&p[n],&n),--n;
-							if(a>=0x5d0 && a<=0x5ea) c = uh2l[a-0x5d0];
-						}
-						if(c=='*' ||
-						   (c>='A' && c<='Z' && (a=l2h[c-'A'])>=0) ||
-							(c>='a' && c<='z' && (a=l2h[c-'a'])>=0)) {
-							if(c=='*') v1 = &e->vt;
-							else v1 = &e->va[a];
-							if(c0) {
-								if(c0=='<') q_input(e,v1,0);
-							} else q_output(e,v1);
-							p += n+1;
-							continue;
-						}
-						if(c0) q_outc(c0,e->out);
-						c = *p++;
-					}
-					else if(c=='\\') c = '\n';
-					else if(c=='^') c = '\t';
-					if(!isunicode(c)) q_outc(c,e->out);
-					else {
-						--p;
-						q_out_utf8(&p,e->out);
-					}
-				}
-			}
-		}
-		return;
-	}
-	newline = 1;
-}
+long ex_fused[EX_QUICK-EX_FUSE]; // Number of times each fused operator was executed
+
+int jit = 0;
+static int flush = -1; // Output flush policy, or by terminal
+static const char *cache = NULL; // Directory of compiled scripts shared between processes
+
+static void run(q_script *sc,FILE *in,FILE *out);
+static str *file_map(const char *file);
+static q_pos file_skip(const utf8_t *p,q_pos l);
+static int file_image(const char *file);
+static void script_free(q_script *sc);
+static q_script *include_open(const char *file);
+static void include_release();
+
+/* Threaded dispatch through computed goto is used when compiled with GCC,
+ * define Q_SWITCH to use the portable switch instead. Arithmetic operators
+ * then jump to a handler for the types of V2 and V1.
+ *
+ * Operators are also quickened: each token records the types of its
+ * operands, and when the same types are seen twice in a row for ints or
+ * floats the code of the token is rewritten to a specialized handler.
+ * If the types later differ the handler restores the generic code, and
+ * the token is never quickened again. Quickening is only done in the
+ * threaded build, with Q_SWITCH exec_quicken is empty. */
+#if defined __GNUC__ && !defined Q_SWITCH
+#define EXEC_THREADED
+#define exec_label(l) l:
+#define exec_typed(t) goto *t[v2->type<<2|v1->type]
+#define exec_quicken(x,y,ii,ff) \
+	if(t->code>=EX_FUSE); \
+	else if(t->type!=(a=x->type<<2|y->type)) t->type = t->type? -1 : a; \
+	else if(a==(INT<<2|INT)) t->code = ii; \
+	else if(a==(FLOAT<<2|FLOAT) && ff) t->code = ff
+#else
+#define exec_label(l)
+#define exec_typed(t)
+#define exec_quicken(x,y,ii,ff)
+#endif
 
-// Get next variable or operator char:
-#define next(c,o,s,p) \
-while((c=s[++p]) && !(o=op[c]))
-
-void q_block_end(q_env *e,int f,int r) {
-	int n = 1,a,b,c,o;
-	q_block *b0 = e->b0;
-	while(1) {
-		next(c,o,e->src,e->pos);
-		if(!c) break; // EOF
-
-		if(o>=0x1000 && (a=op[e->src[e->pos+1]])>=0x1000)
-			if((b=op_combine(o,a))) ++e->pos,o = b;
-
-		if(o==OP_LBLOCK) ++n;
-		else if(o==OP_ELSE && n==1 && f) break;
-		else if(o==OP_RBLOCK && !--n) {
-			if(r) { // Return
-				if(b0->end!=b0->pos) e->pos = b0->end;
-				e->b0 = &e->stack[b0->end_block];
-			}
-			break;
-		}
-	}
-	if(c=='\0') { // End of script, exit
-		e->stack_index = 0;
-		e->b0 = &e->stack[e->stack_index];
-		e->pos = e->b0->end;
+// Index of last token at or before position in source, or -1:
+static int q_tok_index(q_env *e,q_pos pos) {
+	int i = 0,j = e->tok_len,m;
+	while(i<j) {
+		m = (i+j)>>1;
+		if(e->tok[m].pos<=pos) i = m+1;
+		else j = m;
 	}
+	return i-1;
 }
 
+/* Operators are also done by the functions of qc.h in scripts written
+ * with --emit-c. Their semantics must stay the same: arithmetic on ints
+ * and floats with ints widened, comparisons through var_cmp, truncated
+ * to int, and + joining when either operand is a string. */
 void q_exec(q_env *e) {
-	int a = 0,b,c,d,l,o;
-	char *p,*q;
+	int a = 0,c,o;
+	char *p;
 	double f;
 	var *v0,*v1,*v2;
 	q_block *b1;
+	q_token *t,*t1;
 	str *s = NULL;
+#ifdef EXEC_THREADED
+	static void *exec_op[EX_LEN] = {
+		[EX_NONE]    = &&exec_next,   [EX_INDEX]   = &&exec_next,   [EX_CARET]   = &&exec_next,
+		[EX_ADD]     = &&op_add,      [EX_SUB]     = &&op_sub,      [EX_MUL]     = &&op_mul,
+		[EX_DIV]     = &&op_div,      [EX_MOD]     = &&op_mod,      [EX_ADD2]    = &&op_add2,
+		[EX_SUB2]    = &&op_sub2,     [EX_MUL2]    = &&op_mul2,     [EX_DIV2]    = &&op_div2,
+		[EX_MOD2]    = &&op_mod2,     [EX_OUTPUT]  = &&op_output,   [EX_SET]     = &&op_set,
+		[EX_NUM]     = &&op_num,      [EX_STR]     = &&op_str,      [EX_VAR]     = &&op_var,
+		[EX_GOTO]    = &&op_goto,     [EX_LEXPR]   = &&op_lexpr,    [EX_REXPR]   = &&op_rexpr,
+		[EX_LBLOCK]  = &&op_lblock,   [EX_RBLOCK]  = &&op_rblock,   [EX_ELSE]    = &&op_else,
+		[EX_NIF]     = &&op_nif,      [EX_IF]      = &&op_if,       [EX_IS]      = &&op_logic,
+		[EX_NIS]     = &&op_logic,    [EX_EQ]      = &&op_logic,    [EX_NEQ]     = &&op_logic,
+		[EX_LT]      = &&op_logic,    [EX_GT]      = &&op_logic,    [EX_LTEQ]    = &&op_logic,
+		[EX_GTEQ]    = &&op_logic,    [EX_INT2]    = &&op_int2,     [EX_INT]     = &&op_int,
+		[EX_FLOAT]   = &&op_float,    [EX_INC]     = &&op_inc,      [EX_DEC]     = &&op_dec,
+		[EX_POW]     = &&op_pow,      [EX_SQRT]    = &&op_sqrt,     [EX_LSHIFT2] = &&op_lshift2,
+		[EX_LSHIFT]  = &&op_lshift,   [EX_RSHIFT2] = &&op_rshift2,  [EX_RSHIFT]  = &&op_rshift,
+		[EX_AND2]    = &&op_and2,     [EX_AND]     = &&op_and,      [EX_OR2]     = &&op_or2,
+		[EX_OR]      = &&op_or,       [EX_XOR2]    = &&op_xor2,     [EX_XOR]     = &&op_xor,
+		[EX_NOT2]    = &&op_not2,     [EX_NOT]     = &&op_not,      [EX_ABS]     = &&op_abs,
+		[EX_NEG]     = &&op_neg,      [EX_FLOOR]   = &&op_floor,    [EX_CEIL]    = &&op_ceil,
+		[EX_RED]     = &&op_red,      [EX_ELVIS2]  = &&op_elvis2,   [EX_ELVIS]   = &&op_elvis,
+		[EX_INPUT]   = &&op_input,    [EX_DOUT]    = &&op_dout,     [EX_DOUTE]   = &&exec_next,
+		[EX_DSTR]    = &&op_dstr,     [EX_DSTRE]   = &&exec_next,   [EX_POS]     = &&op_pos,
+		[EX_LOOP]    = &&op_loop,     [EX_RETURN]  = &&op_return,   [EX_INCLUDE] = &&op_include,
+		[EX_EXEC]    = &&op_exec,     [EX_COPEN]   = &&exec_next,   [EX_CCLOSE]  = &&exec_next,
+		[EX_VAR2]    = &&op_var2,     [EX_VAR2_SET] = &&op_var2_set, [EX_VAR_OUTPUT] = &&op_var_output,
+		[EX_INC_CMP_IF] = &&op_inc_cmp_if, [EX_IF_LOOP] = &&op_if_loop,
+		[EX_ADD_II]  = &&op_add_qii,  [EX_ADD_FF]  = &&op_add_qff,  [EX_SUB_II]  = &&op_sub_qii,
+		[EX_SUB_FF]  = &&op_sub_qff,  [EX_MUL_II]  = &&op_mul_qii,  [EX_MUL_FF]  = &&op_mul_qff,
+		[EX_DIV_II]  = &&op_div_qii,  [EX_DIV_FF]  = &&op_div_qff,  [EX_MOD_II]  = &&op_mod_qii,
+		[EX_CMP_II]  = &&op_cmp_qii,  [EX_IR]      = &&op_ir,
+	};
+	// Arithmetic handlers by type, [V2][V1]: VOID, INT, FLOAT, STR
+	static void *exec_add[16] = {
+		&&exec_next,  &&exec_next,  &&exec_next,  &&op_add_s,
+		&&exec_next,  &&op_add_ii,  &&op_add_if,  &&op_add_s,
+		&&exec_next,  &&op_add_fi,  &&op_add_ff,  &&op_add_s,
+		&&op_add_s,   &&op_add_s,   &&op_add_s,   &&op_add_s,
+	};
+	static void *exec_sub[16] = {
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+		&&exec_next,  &&op_sub_ii,  &&op_sub_if,  &&exec_next,
+		&&exec_next,  &&op_sub_fi,  &&op_sub_ff,  &&exec_next,
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+	};
+	static void *exec_mul[16] = {
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+		&&exec_next,  &&op_mul_ii,  &&op_mul_if,  &&exec_next,
+		&&exec_next,  &&op_mul_fi,  &&op_mul_ff,  &&exec_next,
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+	};
+	static void *exec_div[16] = {
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+		&&exec_next,  &&op_div_ii,  &&op_div_if,  &&exec_next,
+		&&exec_next,  &&op_div_fi,  &&op_div_ff,  &&exec_next,
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+	};
+	static void *exec_mod[16] = {
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+		&&exec_next,  &&op_mod_ii,  &&op_mod_if,  &&exec_next,
+		&&exec_next,  &&op_mod_fi,  &&op_mod_ff,  &&exec_next,
+		&&exec_next,  &&exec_next,  &&exec_next,  &&exec_next,
+	};
+#endif
 //if(debug) q_outd(0,"exec:" STR_NL "%s" STR_NL,e->src);
 
 exec_start:
 	while(e) {
-		next(c,o,e->src,e->pos);
-		if(!c) goto exec_end; // EOF
-
-//if(debug) q_outd(0,"exec: %c" STR_NL,c);
+		if(++e->pos>=e->tok_len) goto exec_end; // EOF
+		t = &e->tok[e->pos];
+		o = t->op;
 
-		if(isunicode(c)) { // UTF-8 unicode
-			c = utf8_decode(&e->src[e->pos],&e->pos); // Get unicode
-			--e->pos;
-			if(c>=0x5d0 && c<=0x5ea) // Hebrew unicode
-				c = uh2l[c-0x5d0],o = op[c]; // To latin
-		}
+//if(debug) q_outd(0,"exec: %c" STR_NL,e->src[t->pos]);
 
-		if(o>=0x1000 && (a=op[e->src[e->pos+1]])>=0x1000)
-			if((b=op_combine(o,a))) ++e->pos,o = b;
-
-if(debug && o>=0x1000) q_outd(0,"Operator: %c%c [0x%X]" STR_NL,c,a>=0x1000 && b? e->src[e->pos] : ' ',o);
+if(debug && o>=0x1000) q_outd(0,"Operator: %c%c [0x%X]" STR_NL,e->src[t->pos],t->len==2? e->src[t->pos+1] : ' ',o);
 
 		v0 = e->v0;
 		v1 = e->v1;
 		v2 = e->v2;
 
 		if(o&0xE000) {
-			b = e->pos;
-			next(d,a,e->src,b);
-			if(a==OP_STR && e->src[b+1]=='>') a = 0; // Ignore direct output strings: ~>...
-			if(a==OP_NUM || a==OP_STR) { // Number or String
-				e->pos = b;
-				if(a==OP_NUM) // Number
-					var_num(&e->vt,&e->src[e->pos],&e->pos);
-				else // String
-					q_var_str(e,&e->vt,&e->src[e->pos],&e->pos);
+			if(t->arg) { // Number or String
+				t1 = &e->tok[++e->pos];
+				if(t1->arg>=0) // Number or constant string
+					var_set(&e->vt,&e->cst[t1->arg]);
+				else // String with inserted variables
+					q_var_tpl(e,&e->vt,~t1->arg);
 //if(debug) q_outd(1,"vt [%c, %d]: ",h2l[(int)e->vt.index],e->vt.type);
 				if(o&0x2000) v0 = &e->vt;
 				else if(o&0x10000) v2 = &e->vt;
@@ -416,48 +318,61 @@ if(debug && o>=0x1000) q_outd(0,"Operator: %c%c [0x%X]" STR_NL,c,a>=0x1000 && b?
 
 //if(debug) q_outd(0,"exec(c: %c%c, o: 0x%X)  V0[%c, %d]  V1[%c, %d]  V2[%c, %d]" STR_NL,c,c0,o,h2l[(int)v0->index],v0->type,h2l[(int)v1->index],v1->type,h2l[(int)v2->index],v2->type);
 
+#ifdef EXEC_THREADED
+		goto *exec_op[t->code];
+#endif
 		switch(o) {
-			case OP_ADD2:
+			case OP_ADD2: exec_label(op_add2)
 				v2 = v0;
-			case OP_ADD:
+			case OP_ADD: exec_label(op_add)
+				exec_quicken(v2,v1,EX_ADD_II,EX_ADD_FF);
+				exec_typed(exec_add);
 //if(debug) q_outd(0,"OP_ADD [%c, %d] +  [%c, %d]" STR_NL,h2l[(int)e->v2->index],e->v2->type,h2l[(int)e->v1->index],e->v1->type);
-					  if(v1->type==STR   || v2->type==STR)   v0->s = str_join(v2->s,v1->s),         v0->type = STR;
+					  if(v1->type==STR   || v2->type==STR)   v0->s = var_join(v0,v2,v1),            v0->type = STR;
 				else if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         + v1->f,         v0->type = FLOAT;
 				else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i + v1->f,         v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         + (double)v1->i, v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         + v1->i,         v0->type = INT;
 				break;
 
-			case OP_SUB2:
+			case OP_SUB2: exec_label(op_sub2)
 				v2 = v0;
-			case OP_SUB:
+			case OP_SUB: exec_label(op_sub)
+				exec_quicken(v2,v1,EX_SUB_II,EX_SUB_FF);
+				exec_typed(exec_sub);
 					  if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         - v1->f,         v0->type = FLOAT;
 				else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i - v1->f,         v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         - (double)v1->i, v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         - v1->i,         v0->type = INT;
 				break;
 
-			case OP_MUL2:
+			case OP_MUL2: exec_label(op_mul2)
 				v2 = v0;
-			case OP_MUL:
+			case OP_MUL: exec_label(op_mul)
+				exec_quicken(v2,v1,EX_MUL_II,EX_MUL_FF);
+				exec_typed(exec_mul);
 					  if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         * v1->f,         v0->type = FLOAT;
 				else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i * v1->f,         v0->type = FLOAT;
-				else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->i         * (double)v1->i, v0->type = FLOAT;
+				else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         * (double)v1->i, v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         * v1->i,         v0->type = INT;
 				break;
 
-			case OP_DIV2:
+			case OP_DIV2: exec_label(op_div2)
 				v2 = v0;
-			case OP_DIV:
+			case OP_DIV: exec_label(op_div)
+				exec_quicken(v2,v1,EX_DIV_II,EX_DIV_FF);
+				exec_typed(exec_div);
 					  if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         / v1->f,         v0->type = FLOAT;
 				else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i / v1->f,         v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         / (double)v1->i, v0->type = FLOAT;
 				else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         / v1->i,         v0->type = INT;
 				break;
 
-			case OP_MOD2:
+			case OP_MOD2: exec_label(op_mod2)
 				v2 = v0;
-			case OP_MOD:
+			case OP_MOD: exec_label(op_mod)
+				exec_quicken(v2,v1,EX_MOD_II,0);
+				exec_typed(exec_mod);
 				if(v1->type==FLOAT || v2->type==FLOAT) {
 					if(v1->type==FLOAT && v2->type==FLOAT)   v0->f = modf(v2->f/v1->f,&f),          v0->type = FLOAT;
 					else if(v1->type==INT)                   v0->f = modf(v2->f/(double)v1->i,&f),  v0->type = FLOAT;
@@ -465,44 +380,41 @@ if(debug && o>=0x1000) q_outd(0,"Operator: %c%c [0x%X]" STR_NL,c,a>=0x1000 && b?
 				} else if(v1->type==INT && v2->type==INT)   v0->i = v2->i         % v1->i,         v0->type = INT;
 				break;
 
-			case OP_OUTPUT:
+			case OP_OUTPUT: exec_label(op_output)
 //if(debug) q_outd(0,"OP_OUTPUT[%c, %d]" STR_NL,h2l[(int)v0->index],v0->type);
 				q_output(e,v0);
+				s = NULL; // Input into V0 frees the string
 				break;
 
-			case OP_SET:
+			case OP_SET: exec_label(op_set)
 				var_set(v0,v1);
 				s = NULL;
 				break;
 
-			case OP_NUM:
-				var_num(&e->vt,&e->src[e->pos],&e->pos);
+			case OP_NUM: exec_label(op_num)
+				var_set(&e->vt,&e->cst[t->arg]);
 				var_set(v0,&e->vt);
 				s = NULL;
 //if(debug) {q_outd(1,"OP_NUM[%c, %d]: ",h2l[(int)v0->index],v0->type);
 				break;
 
-			case OP_STR:
-				q_var_str(e,&e->vt,&e->src[e->pos],&e->pos);
+			case OP_STR: exec_label(op_str)
+				if(t->arg>=0) var_set(&e->vt,&e->cst[t->arg]);
+				else q_var_tpl(e,&e->vt,~t->arg);
 				var_set(v0,&e->vt);
 //if(debug) q_outd(0,"OP_STR[%c, %d]: %s" STR_NL,h2l[(int)v0->index],v0->type,(char *)str_data(v0->s));
 				s = NULL;
 				break;
 
-			case OP_VAR:
-				if((c>='A' && c<='Z' && (a=l2h[c-'A'])!=-1) ||
-					(c>='a' && c<='z' && (a=l2h[c-'a'])!=-1)) {
-					e->v2 = e->v1;
-					e->v1 = e->v0;
-					e->v0 = &e->va[a];
-					s = NULL;
-				}
+			case OP_VAR: exec_label(op_var)
+				e->v2 = e->v1;
+				e->v1 = e->v0;
+				e->v0 = &e->va[t->arg];
+				s = NULL;
 				break;
 
-			case OP_GOTO:
-				a = var_int(v0);
-				if(a<0) a = -1;
-				else if(a>=e->len) a = e->len-1;
+			case OP_GOTO: exec_label(op_goto)
+				a = q_tok_index(e,var_int(v0));
 				if(e->stack_index+1==STACK) goto exec_err_stack_overflow;
 				b1 = &e->stack[++e->stack_index];
 				b1->pos         = a;
@@ -517,7 +429,7 @@ if(debug && o>=0x1000) q_outd(0,"Operator: %c%c [0x%X]" STR_NL,c,a>=0x1000 && b?
 if(debug) q_outd(0,"OP_GOTO[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_LEXPR:
+			case OP_LEXPR: exec_label(op_lexpr)
 				if(e->stack_index+1==STACK) goto exec_err_stack_overflow;
 				b1 = &e->stack[++e->stack_index];
 				*b1 = *e->b0;
@@ -528,7 +440,7 @@ if(debug) q_outd(0,"OP_GOTO[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_bl
 if(debug) q_outd(0,"OP_LEXPR[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_REXPR:
+			case OP_REXPR: exec_label(op_rexpr)
 				if(e->stack_index<=0) goto exec_end;
 				b1 = &e->stack[--e->stack_index];
 if(debug) q_outd(0,"OP_REXPR expr-a: %d, expr_state-a: %d, expr-b: %d, expr_state-b: %d" STR_NL,b1->expr,b1->expr_state,e->b0->expr,e->b0->expr_state);
@@ -541,7 +453,7 @@ if(debug) q_outd(0,"OP_REXPR expr-a: %d, expr_state-a: %d, expr-b: %d, expr_stat
 if(debug) q_outd(0,"OP_REXPR[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_LBLOCK:
+			case OP_LBLOCK: exec_label(op_lblock)
 				if(e->stack_index+1==STACK) goto exec_err_stack_overflow;
 				b1 = &e->stack[++e->stack_index];
 				b1->pos         = e->pos;
@@ -555,7 +467,7 @@ if(debug) q_outd(0,"OP_REXPR[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_b
 if(debug) q_outd(0,"OP_LBLOCK[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_RBLOCK:
+			case OP_RBLOCK: exec_label(op_rblock)
 				b1 = &e->stack[e->b0->end_block];
 				e->stack_index = b1->index;
 				if(e->b0->end!=e->b0->pos) e->pos = e->b0->end;
@@ -563,21 +475,21 @@ if(debug) q_outd(0,"OP_LBLOCK[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_
 if(debug) q_outd(0,"OP_RBLOCK[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_ELSE:
-				q_block_end(e,0,1);
+			case OP_ELSE: exec_label(op_else) // Skip to end of block
+				e->pos = t->jmp;
 if(debug) q_outd(0,"OP_ELSE[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_NIF:
+			case OP_NIF: exec_label(op_nif)
 				e->b0->expr = !e->b0->expr;
-			case OP_IF:
+			case OP_IF: exec_label(op_if)
 				a = e->b0->expr;
 				e->b0->expr = -1; // Reset expr for currect block
-				if(a==0) q_block_end(e,1,1);
+				if(a==0) e->pos = t->jmp; // Skip to else, or end of block
 if(debug) q_outd(0,"OP_IF[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_IS: // Logical operators
+			case OP_IS: exec_label(op_logic) // Logical operators
 			case OP_NIS:
 			case OP_EQ:
 			case OP_NEQ:
@@ -585,24 +497,28 @@ if(debug) q_outd(0,"OP_IF[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_bloc
 			case OP_GT:
 			case OP_LTEQ:
 			case OP_GTEQ:
+				if(o!=OP_IS && o!=OP_NIS) {
+					exec_quicken(v0,v1,EX_CMP_II,0);
+				}
 					  if(o==OP_IS)   a = !var_empty(v0);
 				else if(o==OP_NIS)  a = var_empty(v0);
-				else if(o==OP_EQ)   a = var_cmp(v0,v1)==0;
-				else if(o==OP_NEQ)  a = var_cmp(v0,v1)!=0;
+				else if(o==OP_EQ)   a = var_eq(v0,v1);
+				else if(o==OP_NEQ)  a = !var_eq(v0,v1);
 				else if(o==OP_LT)   a = var_cmp(v0,v1)<0;
 				else if(o==OP_GT)   a = var_cmp(v0,v1)>0;
 				else if(o==OP_LTEQ) a = var_cmp(v0,v1)<=0;
 				else if(o==OP_GTEQ) a = var_cmp(v0,v1)>=0;
 				else break;
+				exec_label(op_logic_expr)
 if(debug) q_outd(0,"Logic: expr: %d, expr_state: %d, a: %d, o: 0x%X, v0type: %d, v0i: %ld" STR_NL,e->b0->expr,e->b0->expr_state,a,o,v0->type,v0->i);
 				if(e->b0->expr==-1) e->b0->expr = a;
 				else if(e->b0->expr_state==EXPR_AND) e->b0->expr = (e->b0->expr && a);
 				else if(e->b0->expr_state==EXPR_OR)  e->b0->expr = (e->b0->expr || a);
 				break;
 
-			case OP_INT2:
+			case OP_INT2: exec_label(op_int2)
 				v1 = v0;
-			case OP_INT:
+			case OP_INT: exec_label(op_int)
 				if(v1->type==STR) {
 					if(str_is_int(v1->s))   v0->i = strtol((char *)str_data(v1->s),&p,0), v0->type = INT;
 					else                    v0->i = str_val_sum(v1->s,0),                 v0->type = INT;
@@ -610,258 +526,532 @@ if(debug) q_outd(0,"Logic: expr: %d, expr_state: %d, a: %d, o: 0x%X, v0type: %d,
 				  else if(v1->type==INT)   v0->i = var_ired(v1->i,10),                   v0->type = INT;
 				break;
 
-			case OP_FLOAT:
+			case OP_FLOAT: exec_label(op_float)
 					  if(v0->type==FLOAT)   v0->f = round(v1->f);
 				else if(v0->type==INT)     v0->f = (double)v1->i,                        v0->type = FLOAT;
 				break;
 
-			case OP_INC:
+			case OP_INC: exec_label(op_inc)
 					  if(v0->type==INT)   ++v0->i;
 				else if(v0->type==FLOAT) ++v0->f;
 				break;
 
-			case OP_DEC:
+			case OP_DEC: exec_label(op_dec)
 					  if(v0->type==INT)   --v0->i;
 				else if(v0->type==FLOAT) --v0->f;
 				break;
 
-			case OP_POW:
+			case OP_POW: exec_label(op_pow)
 					  if(v1->type==FLOAT && v2->type==FLOAT) v0->f = pow(v2->f,v1->f),              v0->type = FLOAT;
 				else if(v1->type==FLOAT && v2->type==INT)   v0->f = pow((double)v2->i,v1->f),      v0->type = FLOAT;
 				else if(v1->type==INT && v2->type==FLOAT)   v0->f = pow(v2->f,(double)v1->i),      v0->type = FLOAT;
 				else if(v1->type==INT && v2->type==INT)     v0->f = var_ipow(v2->i,v1->i),         v0->type = INT;
 				break;
 
-			case OP_SQRT:
+			case OP_SQRT: exec_label(op_sqrt)
 					  if(v1->type==FLOAT)                    v0->f = sqrt(v1->f),                   v0->type = FLOAT;
 				else if(v1->type==INT)                      v0->i = var_isqrt(v1->i),              v0->type = INT;
 				break;
 
-			case OP_LSHIFT2:
+			case OP_LSHIFT2: exec_label(op_lshift2)
 				v2 = v0;
-			case OP_LSHIFT:
+			case OP_LSHIFT: exec_label(op_lshift)
 				if(v1->type==INT && v2->type==INT)    v0->i = (v2->i << v1->i), v0->type = INT;
 				break;
 
-			case OP_RSHIFT2:
+			case OP_RSHIFT2: exec_label(op_rshift2)
 				v2 = v0;
-			case OP_RSHIFT:
+			case OP_RSHIFT: exec_label(op_rshift)
 				if(v1->type==INT && v2->type==INT)    v0->i = (v2->i >> v1->i), v0->type = INT;
 				break;
 
-			case OP_AND2:
+			case OP_AND2: exec_label(op_and2)
 				v2 = v0;
-			case OP_AND:
+			case OP_AND: exec_label(op_and)
 				if(v1->type==INT && v2->type==INT)    v0->i = (v2->i &  v1->i), v0->type = INT;
 				break;
 
-			case OP_OR2:
+			case OP_OR2: exec_label(op_or2)
 				v2 = v0;
-			case OP_OR:
+			case OP_OR: exec_label(op_or)
 				if(v1->type==INT && v2->type==INT)    v0->i = (v2->i |  v1->i), v0->type = INT;
 				break;
 
-			case OP_XOR2:
+			case OP_XOR2: exec_label(op_xor2)
 				v2 = v0;
-			case OP_XOR:
+			case OP_XOR: exec_label(op_xor)
 				if(v1->type==INT && v2->type==INT)    v0->i = (v2->i ^  v1->i), v0->type = INT;
 				break;
 
-			case OP_NOT2:
+			case OP_NOT2: exec_label(op_not2)
 				v1 = v0;
-			case OP_NOT:
+			case OP_NOT: exec_label(op_not)
 				if(v1->type==INT)                     v0->i = ~v1->i,           v0->type = INT;
 				break;
 
-			case OP_ABS:
+			case OP_ABS: exec_label(op_abs)
 					  if(v1->type==FLOAT && v1->f<0.0) v0->f = -v1->f,           v0->type = FLOAT;
 				else if(v1->type==INT   && v1->i<0)   v0->i = -v1->i,           v0->type = INT;
 				break;
 
-			case OP_NEG:
+			case OP_NEG: exec_label(op_neg)
 					  if(v1->type==FLOAT && v1->f>0.0) v0->f = -v1->f,           v0->type = FLOAT;
 				else if(v1->type==INT &&   v1->i>0)   v0->i = -v1->i,           v0->type = INT;
 				break;
 
-			case OP_FLOOR:
+			case OP_FLOOR: exec_label(op_floor)
 				if(v0->type==FLOAT) v0->f = floor(v0->f);
 				break;
 
-			case OP_CEIL:
+			case OP_CEIL: exec_label(op_ceil)
 				if(v0->type==FLOAT) v0->f = ceil(v0->f);
 				break;
 
-			case OP_RED:
+			case OP_RED: exec_label(op_red)
 					  if(v2->type==STR && v1->type==INT) v0->i = var_ired(str_val_sum(v2->s,0),v1->i), v0->type = INT;
 				else if(v2->type==INT && v1->type==INT) v0->i = var_ired(v2->i,v1->i),                v0->type = INT;
 				break;
 
-			case OP_ELVIS2:
+			case OP_ELVIS2: exec_label(op_elvis2)
 				v2 = v1,v1 = v0;
-			case OP_ELVIS:
+			case OP_ELVIS: exec_label(op_elvis)
 				if(var_empty(v1)) v1 = v2;
 				var_set(v0,v1);
 				s = NULL;
 				break;
 
-			case OP_INPUT:
+			case OP_INPUT: exec_label(op_input)
 				q_input(e,v0,0);
 				break;
 
-			case OP_DOUT:
-				for(l=0,p=(char *)&e->src[e->pos+1]; (c=p[l]); ++l) {
-					if(c=='<' && p[l+1]=='?') break;
-					fputc(c,e->out);
+			case OP_DOUT: exec_label(op_dout)
+				if(t->arg>0) {
+					q_write(e->wr,&e->src[t->pos+2],t->arg);
+					c = e->src[t->pos+1+t->arg];
 					newline = c!='\n' && c!='\r';
 				}
-				if(!c) goto exec_end;
-				e->pos += l+2;
-if(debug) q_outd(0,"OP_DOUT: %c" STR_NL,e->src[e->pos]);
+if(debug) q_outd(0,"OP_DOUT: %d" STR_NL,t->arg);
 				s = NULL;
 				break;
 			case OP_DOUTE:
 				break;
 
-			case OP_DSTR:
-				for(l=0,p=(char *)&e->src[e->pos+1],a=1; (c=p[l]); ++l) {
-					if(c=='&' && p[l+1]=='>') ++a,++l;
-					else if(c=='<' && p[l+1]=='&') {
-						if(!--a) break;
-						else ++l;
-					}
-				}
-				if(!c) goto exec_end;
-				var_set_str(&e->vt,str_new_dup(&e->src[e->pos+1],l));
+			case OP_DSTR: exec_label(op_dstr)
+				var_set(&e->vt,&e->cst[t->arg]);
 				var_set(v0,&e->vt);
-				e->pos += l+2;
-if(debug) q_outd(0,"OP_DSTR: %c, str: \"%s\"" STR_NL,e->src[e->pos],(char *)str_data(v0->s));
+if(debug) q_outd(0,"OP_DSTR: %ld, str: \"%s\"" STR_NL,v0->s->len,(char *)str_data(v0->s));
 				s = NULL;
 				break;
 			case OP_DSTRE:
 				break;
 
-			case OP_POS:
-				b = e->pos;
-				next(d,a,e->src,b);
-//if(debug) q_outd(0,"OP_POS: %c" STR_NL,d);
-				if(a==OP_LBLOCK) { // Followed by a block
-					e->pos = b;
-					var_set_int(v0,e->pos);
-					q_block_end(e,0,0);
+			case OP_POS: exec_label(op_pos)
+				if(e->pos+1<e->tok_len && t[1].op==OP_LBLOCK) { // Followed by a block
+					t = &e->tok[++e->pos];
+					var_set_int(v0,t->pos);
+					e->pos = t->jmp;
 //if(debug) q_outd(0,"OP_POS: pos = %d" STR_NL,e->pos);
 				} else {
-					var_set_int(v0,e->pos);
+					var_set_int(v0,t->pos+t->len-1);
 				}
 				s = NULL;
 				break;
 
-			case OP_LOOP:
+			case OP_LOOP: exec_label(op_loop)
 				e->b0->expr = -1;
 				e->pos = e->b0->pos;
+				if(jit) e->pos = q_jit_loop(e);
 if(debug) q_outd(0,"OP_LOOP[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_RETURN:
+			case OP_RETURN: exec_label(op_return)
 				e->pos = e->b0->ret;
 				e->b0 = &e->stack[e->b0->ret_block];
 if(debug) q_outd(0,"OP_RETURN[%d] pos: %d, end: %d, end_block: %d, ret: %d, ret_block: %d, expr: %d, expr_state: %d" STR_NL,e->b0->index,e->b0->pos,e->b0->end,e->b0->end_block,e->b0->ret,e->b0->ret_block,e->b0->expr,e->b0->expr_state);
 				break;
 
-			case OP_INCLUDE:
+			case OP_INCLUDE: exec_label(op_include)
 				if(v0->type==STR) {
-					a = 0,p = file_read((const char *)str_data(v0->s),&l);
-					if(p && l>0) {
-						if(*p=='#' && p[1]=='!') {
-							q = strchr(p,'\n');
-							if(!q) q = strchr(p,'\r');
-							if(q) a = (int)(q-p)+1;
-						}
-if(debug) q_outd(0,"OP_INCLUDE: len: %d, src:" STR_NL "%s" STR_NL,l,p);
-						if(l-a>0) e = q_open(p,a,l,e->in,e->out,e);
+					q_script *sc = include_open((const char *)str_data(v0->s));
+					if(sc) {
+						e = q_open_script(sc,e->in,e->out,e);
+						script_free(sc);
 					}
 				}
 				break;
 
-			case OP_EXEC:
-if(debug) q_outd(0,"OP_EXEC: len: %d, src:" STR_NL "%s" STR_NL,v0->s->len,(char *)str_data(v0->s));
-				if(v0->type==STR && v0->s->len>0) {
-					p = (char *)malloc(v0->s->len+1);
-					strcpy(p,(char *)str_data(v0->s));
-					e = q_open(p,0,v0->s->len,e->in,e->out,e);
+			case OP_EXEC: exec_label(op_exec)
+if(debug) q_outd(0,"OP_EXEC: len: %ld, src:" STR_NL "%s" STR_NL,v0->s->len,(char *)str_data(v0->s));
+				if(v0->type==STR && v0->s->len>0) { // Run the string itself, holding a reference
+					e = q_open_str(v0->s,0,e->in,e->out,e);
 				}
 				break;
 
-			case OP_COPEN:
-				for(a=1; (c=e->src[++e->pos]); ) {
-					if(c=='/' && e->src[e->pos+1]=='*') ++a,++e->pos;
-					else if(c=='*' && e->src[e->pos+1]=='/' && !--a) break;
-				}
-				if(c=='\0') --e->pos;
-				else ++e->pos;
-				break;
+			case OP_COPEN: // Comments are skipped by the lexer
 			case OP_CCLOSE:break;
 		}
+#ifdef EXEC_THREADED
+exec_next:
+#endif
 		if(s && (v0->type!=STR || v0->s!=s)) { // Free string if value of V0 has changed
 //if(debug) q_outd(0,"str_free(%s)" STR_NL,(char *)str_data(s));
 			str_free(s);
 			s = NULL;
 		}
 	}
+#ifdef EXEC_THREADED
+	if(0) { // Arithmetic handlers by type of V2 and V1
+op_add_ii: v0->i = v2->i         + v1->i,                     v0->type = INT;   goto exec_next;
+op_add_if: v0->f = (double)v2->i + v1->f,                     v0->type = FLOAT; goto exec_next;
+op_add_fi: v0->f = v2->f         + (double)v1->i,             v0->type = FLOAT; goto exec_next;
+op_add_ff: v0->f = v2->f         + v1->f,                     v0->type = FLOAT; goto exec_next;
+op_add_s:  v0->s = var_join(v0,v2,v1),                        v0->type = STR;   goto exec_next;
+
+op_sub_ii: v0->i = v2->i         - v1->i,                     v0->type = INT;   goto exec_next;
+op_sub_if: v0->f = (double)v2->i - v1->f,                     v0->type = FLOAT; goto exec_next;
+op_sub_fi: v0->f = v2->f         - (double)v1->i,             v0->type = FLOAT; goto exec_next;
+op_sub_ff: v0->f = v2->f         - v1->f,                     v0->type = FLOAT; goto exec_next;
+
+op_mul_ii: v0->i = v2->i         * v1->i,                     v0->type = INT;   goto exec_next;
+op_mul_if: v0->f = (double)v2->i * v1->f,                     v0->type = FLOAT; goto exec_next;
+op_mul_fi: v0->f = v2->f         * (double)v1->i,             v0->type = FLOAT; goto exec_next;
+op_mul_ff: v0->f = v2->f         * v1->f,                     v0->type = FLOAT; goto exec_next;
+
+op_div_ii: v0->i = v2->i         / v1->i,                     v0->type = INT;   goto exec_next;
+op_div_if: v0->f = (double)v2->i / v1->f,                     v0->type = FLOAT; goto exec_next;
+op_div_fi: v0->f = v2->f         / (double)v1->i,             v0->type = FLOAT; goto exec_next;
+op_div_ff: v0->f = v2->f         / v1->f,                     v0->type = FLOAT; goto exec_next;
+
+op_mod_ii: v0->i = v2->i         % v1->i,                     v0->type = INT;   goto exec_next;
+op_mod_if: v0->f = modf((double)v2->i/v1->f,&f),              v0->type = FLOAT; goto exec_next;
+op_mod_fi: v0->f = modf(v2->f/(double)v1->i,&f),              v0->type = FLOAT; goto exec_next;
+op_mod_ff: v0->f = modf(v2->f/v1->f,&f),                      v0->type = FLOAT; goto exec_next;
+	}
+	if(0) { // Quickened operators, restoring the generic code when types differ
+op_add_qii: if(o!=OP_ADD) v2 = v0;
+			if(v1->type!=INT   || v2->type!=INT)   goto op_add_deopt;
+			v0->i = v2->i + v1->i, v0->type = INT;   goto exec_next;
+op_add_qff: if(o!=OP_ADD) v2 = v0;
+			if(v1->type!=FLOAT || v2->type!=FLOAT) goto op_add_deopt;
+			v0->f = v2->f + v1->f, v0->type = FLOAT; goto exec_next;
+op_add_deopt: t->type = -1,t->code = q_code(o); goto op_add;
+
+op_sub_qii: if(o!=OP_SUB) v2 = v0;
+			if(v1->type!=INT   || v2->type!=INT)   goto op_sub_deopt;
+			v0->i = v2->i - v1->i, v0->type = INT;   goto exec_next;
+op_sub_qff: if(o!=OP_SUB) v2 = v0;
+			if(v1->type!=FLOAT || v2->type!=FLOAT) goto op_sub_deopt;
+			v0->f = v2->f - v1->f, v0->type = FLOAT; goto exec_next;
+op_sub_deopt: t->type = -1,t->code = q_code(o); goto op_sub;
+
+op_mul_qii: if(o!=OP_MUL) v2 = v0;
+			if(v1->type!=INT   || v2->type!=INT)   goto op_mul_deopt;
+			v0->i = v2->i * v1->i, v0->type = INT;   goto exec_next;
+op_mul_qff: if(o!=OP_MUL) v2 = v0;
+			if(v1->type!=FLOAT || v2->type!=FLOAT) goto op_mul_deopt;
+			v0->f = v2->f * v1->f, v0->type = FLOAT; goto exec_next;
+op_mul_deopt: t->type = -1,t->code = q_code(o); goto op_mul;
+
+op_div_qii: if(o!=OP_DIV) v2 = v0;
+			if(v1->type!=INT   || v2->type!=INT)   goto op_div_deopt;
+			v0->i = v2->i / v1->i, v0->type = INT;   goto exec_next;
+op_div_qff: if(o!=OP_DIV) v2 = v0;
+			if(v1->type!=FLOAT || v2->type!=FLOAT) goto op_div_deopt;
+			v0->f = v2->f / v1->f, v0->type = FLOAT; goto exec_next;
+op_div_deopt: t->type = -1,t->code = q_code(o); goto op_div;
+
+op_mod_qii: if(o!=OP_MOD) v2 = v0;
+			if(v1->type!=INT   || v2->type!=INT)   goto op_mod_deopt;
+			v0->i = v2->i % v1->i, v0->type = INT;   goto exec_next;
+op_mod_deopt: t->type = -1,t->code = q_code(o); goto op_mod;
+
+op_cmp_qii: if(v0->type!=INT || v1->type!=INT) {
+				t->type = -1,t->code = q_code(o);
+				goto op_logic;
+			}
+			c = (int)(v0->i-v1->i); // As var_cmp
+			a = o==OP_LT? c<0 : o==OP_GT? c>0 : o==OP_LTEQ? c<=0 : o==OP_GTEQ? c>=0 : o==OP_EQ? c==0 : c!=0;
+			goto op_logic_expr;
+	}
+	if(0) { // Fused operators, each runs a sequence of tokens as the interpreter would
+op_var2: // X Y
+		++ex_fused[EX_VAR2-EX_FUSE];
+		e->v2 = e->v0;
+		e->v1 = &e->va[t->arg];
+		e->v0 = &e->va[t[1].arg];
+		++e->pos;
+		s = NULL;
+		goto exec_next;
+
+op_var2_set: // X Y :
+		++ex_fused[EX_VAR2_SET-EX_FUSE];
+		e->v2 = e->v0;
+		e->v1 = &e->va[t->arg];
+		e->v0 = &e->va[t[1].arg];
+		var_set(e->v0,e->v1);
+		e->pos += 2;
+		s = NULL;
+		goto exec_next;
+
+op_var_output: // X &
+		++ex_fused[EX_VAR_OUTPUT-EX_FUSE];
+		e->v2 = e->v1;
+		e->v1 = e->v0;
+		e->v0 = &e->va[t->arg];
+		q_output(e,e->v0);
+		++e->pos;
+		s = NULL;
+		goto exec_next;
+
+op_inc_cmp_if: // ++ <= ?
+		++ex_fused[EX_INC_CMP_IF-EX_FUSE];
+			  if(v0->type==INT)   ++v0->i;
+		else if(v0->type==FLOAT) ++v0->f;
+		t1 = &t[1],o = t1->op;
+		++e->pos;
+		if(t1->arg) {
+			var_set(&e->vt,&e->cst[t[2].arg]);
+			v1 = &e->vt;
+			++e->pos;
+		}
+		c = v0->type==INT && v1->type==INT? (int)(v0->i-v1->i) :
+		    o==OP_EQ || o==OP_NEQ? !var_eq(v0,v1) : var_cmp(v0,v1);
+		a = o==OP_LT? c<0 : o==OP_GT? c>0 : o==OP_LTEQ? c<=0 : o==OP_GTEQ? c>=0 : o==OP_EQ? c==0 : c!=0;
+		if(e->b0->expr==-1) e->b0->expr = a;
+		else if(e->b0->expr_state==EXPR_AND) e->b0->expr = (e->b0->expr && a);
+		else if(e->b0->expr_state==EXPR_OR)  e->b0->expr = (e->b0->expr || a);
+		t = &e->tok[++e->pos];
+		a = e->b0->expr;
+		e->b0->expr = -1;
+		if(a==0) e->pos = t->jmp;
+		goto exec_next;
+
+op_if_loop: // ? @<
+		++ex_fused[EX_IF_LOOP-EX_FUSE];
+		a = e->b0->expr;
+		e->b0->expr = -1;
+		if(a==0) e->pos = t->jmp;
+		else {
+			e->pos = e->b0->pos;
+			if(jit) e->pos = q_jit_loop(e);
+		}
+		goto exec_next;
+
+op_ir: // Compiled run of tokens
+		a = q_ir_exec(e,&e->irb[t->jmp]);
+		if(a<t-e->tok) goto *exec_op[q_code(o)]; // Strings added by first token
+		e->pos = a;
+		s = NULL;
+		goto exec_next;
+	}
+#endif
 	if(0) {
 exec_err_stack_overflow:
-		q_oute(0,PACKAGE "[%d]: %s" STR_NL,e->pos,_("Stack overflow"));
+		q_oute(0,PACKAGE "[%ld]: %s" STR_NL,e->tok[e->pos].pos,_("Stack overflow"));
 	}
 exec_end:
 	e = q_close(e);
 	if(e) goto exec_start;
 }
 
+/* Environments are allocated from an arena, and closed environments are
+ * kept in a free list with their stack and variables to be reused. All is
+ * released at once when the script has been run. */
+typedef struct q_arena q_arena;
+
+struct q_arena {
+	q_arena *next;
+	int len;
+	int cap;
+};
+
+#define ARENA               65536
+#define ARENA_DATA          ((sizeof(q_arena)+15)&~15)
+
+static q_arena *arena = NULL;
+static q_env *env_free = NULL;
+
+static void *q_alloc(int l) {
+	q_arena *a = arena;
+	l = (l+15)&~15;
+	if(!a || a->len+l>a->cap) {
+		int cap = l>ARENA? l : ARENA;
+		if(!(a=(q_arena *)malloc(ARENA_DATA+cap))) return NULL;
+		a->next = arena,a->len = 0,a->cap = cap;
+		arena = a;
+	}
+	a->len += l;
+	return (char *)a+ARENA_DATA+a->len-l;
+}
+
+static void q_release() {
+	q_arena *a;
+	while((a=arena)) arena = a->next,free(a);
+	env_free = NULL;
+	include_release();
+}
+
+// Open the source, which is then owned by the environment:
 q_env *q_open(char *src,int pos,int len,FILE *in,FILE *out,q_env *pe) {
 	q_env *e = NULL;
 	if(src && *src) {
-		int i;
-		q_block *stack  = (q_block *)malloc(sizeof(q_block)*STACK);
-		var     *vars   = (var *)malloc(sizeof(var)*VARS);
-
-		e = (q_env *)malloc(sizeof(q_env));
-		*e = (q_env){
-			parent:      pe,
-			src:         (utf8_t *)src,
-			len:         len? len : strlen(src),
-			pos:         pos-1, // Position before first char in src
-			stack:       stack,
-			stack_index: 0, // Position before first block in stack
-			b0:          &stack[0],
-			va:          vars,
-			va_len:      VARS,
-			v0:          &vars[ALEPH],
-			v1:          &vars[ALEPH],
-			v2:          &vars[ALEPH],
-			vt:          { index: 0, type: VOID, i: 0 },
-			in:          in,
-			out:         out
-		};
+		str *s = str_new((utf8_t *)src,len);
+		e = q_open_str(s,pos,in,out,pe);
+		str_free(s);
+	}
+	return e;
+}
 
-		for(i=0; i<STACK; ++i)
-			e->stack[i] = (q_block){
-				index:      i,
-				pos:        e->pos,
-				end:        e->len-1,
-				end_block:  0,
-				ret:        e->len-1,
-				ret_block:  0,
-				expr:       -1,
-				expr_state: EXPR_AND
-			};
+// Lex a string from pos, holding a reference:
+static q_script *script_lex(str *s,q_pos pos) {
+	q_script *sc = (q_script *)malloc(sizeof(q_script));
+	q_env e = {
+		src:   s->data, // Read by the lexer up to len, mappings and views are not copied
+		src_s: str_dup(s->flags&STR_VIEW? s->parent : s), // The view may be copied while running
+		len:   s->len
+	};
+	if(!sc) return NULL;
+	q_lex(&e,pos);
+	if(!debug) q_ir_compile(&e);
+	*sc = (q_script){
+		ref:     1,
+		src:     e.src,
+		src_s:   e.src_s,
+		len:     e.len,
+		pos:     pos,
+		tok:     e.tok,
+		tok_len: e.tok_len,
+		cst:     e.cst,
+		cst_len: e.cst_len,
+		seg:     e.seg,
+		tpl:     e.tpl,
+		tpl_len: e.tpl_len,
+		ir:      e.ir,
+		ir_len:  e.ir_len,
+		irb:     e.irb,
+		irb_len: e.irb_len
+	};
+	return sc;
+}
 
-		for(i=0; i<VARS; ++i)
-			e->va[i] = (var){
-				index: i,
-				type:  VOID,
-				i:     0
-			};
+static void script_free(q_script *sc) {
+	int i;
+	if(sc && --sc->ref==0) {
+		for(i=0; i<sc->cst_len; ++i)
+			var_free(&sc->cst[i]);
+		free(sc->cst);
+		if(!sc->image) {
+			free(sc->tok);
+			free(sc->seg);
+			free(sc->tpl);
+			free(sc->ir);
+			free(sc->irb);
+		}
+		str_free(sc->src_s);
+		free(sc);
+	}
+}
+
+/* Lexed script of a source, from the directory of compiled scripts when
+ * one is given. The image is used when it holds the same source, and is
+ * otherwise written there after lexing. */
+static q_script *script_load(str *s,q_pos pos) {
+	char file[FILENAME_MAX];
+	q_script *sc;
+	if(!cache || !q_image_dir(cache) || !q_image_name(file,sizeof(file),cache,s,pos)) return script_lex(s,pos);
+	if((sc=q_image_open(file,1))) {
+		if(sc->pos==pos && sc->len==s->len && !memcmp(sc->src,s->data,s->len)) return sc;
+		script_free(sc);
+	}
+	if((sc=script_lex(s,pos)) && !q_image_publish(sc,file))
+if(verbose) q_outv(0,"%s: %s" STR_NL,_("Could not write compiled script"),file);
+	return sc;
+}
+
+// Open a string as source, holding a reference:
+q_env *q_open_str(str *s,q_pos pos,FILE *in,FILE *out,q_env *pe) {
+	q_env *e = NULL;
+	q_script *sc;
+	if(s->data && s->len>0 && (sc=script_lex(s,pos))) {
+		e = q_open_script(sc,in,out,pe);
+		script_free(sc);
+	}
+	return e;
+}
+
+// Open a lexed script, holding a reference:
+q_env *q_open_script(q_script *sc,FILE *in,FILE *out,q_env *pe) {
+	q_env *e;
+	int i;
+	q_block *stack;
+	var     *vars;
 
+	if((e=env_free)) {
+		env_free = e->parent;
+		stack = e->stack,vars = e->va;
+	} else {
+		e     = (q_env *)q_alloc(sizeof(q_env));
+		stack = (q_block *)q_alloc(sizeof(q_block)*STACK);
+		vars  = (var *)q_alloc(sizeof(var)*VARS);
+		if(!e || !stack || !vars) return NULL;
 	}
+	++sc->ref;
+	*e = (q_env){
+		parent:      pe,
+		script:      sc,
+		src:         sc->src,
+		src_s:       sc->src_s,
+		len:         sc->len,
+		tok:         sc->tok,
+		tok_len:     sc->tok_len,
+		cst:         sc->cst,
+		cst_len:     sc->cst_len,
+		seg:         sc->seg,
+		tpl:         sc->tpl,
+		tpl_len:     sc->tpl_len,
+		buf:         NULL,
+		buf_cap:     0,
+		pos:         -1, // Position before first token
+		stack:       stack,
+		stack_index: 0, // Position before first block in stack
+		b0:          &stack[0],
+		va:          vars,
+		va_len:      VARS,
+		v0:          &vars[ALEPH],
+		v1:          &vars[ALEPH],
+		v2:          &vars[ALEPH],
+		vt:          { index: 0, type: VOID, i: 0 },
+		in:          in,
+		out:         out,
+		wr:          pe? pe->wr : q_writer_open(out,flush),
+		rd:          pe? pe->rd : q_reader_open(in),
+		jit:         NULL,
+		ir:          sc->ir,
+		ir_len:      sc->ir_len,
+		irb:         sc->irb,
+		irb_len:     sc->irb_len
+	};
+
+	// Blocks are set when pushed, except for the index:
+	e->stack[0] = (q_block){
+		index:      0,
+		pos:        e->pos,
+		end:        e->tok_len-1,
+		end_block:  0,
+		ret:        e->tok_len-1,
+		ret_block:  0,
+		expr:       -1,
+		expr_state: EXPR_AND
+	};
+	for(i=1; i<STACK; ++i)
+		e->stack[i].index = i;
+
+	for(i=0; i<VARS; ++i)
+		e->va[i] = (var){
+			index: i,
+			type:  VOID,
+			i:     0
+		};
 	return e;
 }
 
@@ -871,44 +1061,145 @@ q_env *q_close(q_env *e) {
 		int i;
 //if(verbose) q_outv(0,"%s:" STR_NL "%s" STR_NL "EOF" STR_NL,_("Executed program",s);
 		pe = e->parent;
-		if(!pe || e->src!=pe->src)
-			free(e->src);
-		if(!pe || e->stack!=pe->stack)
-			free(e->stack);
-		if(!pe || e->va!=pe->va) {
-			for(i=0; i<VARS; ++i)
-				var_free(&e->va[i]);
-			free(e->va);
-		}
+		script_free(e->script);
+		free(e->buf);
+		for(i=0; i<VARS; ++i)
+			var_free(&e->va[i]);
 		var_free(&e->vt);
-		free(e);
+		if(!pe) q_writer_close(e->wr),q_reader_close(e->rd);
+		q_jit_free(e);
+		e->parent = env_free,env_free = e;
 	}
 	return pe;
 }
 
-static void run(char *src,int len,FILE *in,FILE *out) {
-	q_env *e = q_open(src,0,len,in,out,NULL);
+static void run(q_script *sc,FILE *in,FILE *out) {
+	q_env *e = sc? q_open_script(sc,in,out,NULL) : NULL;
+	script_free(sc);
 	if(e) q_exec(e);
+	q_release();
+	if(verbose) {
+		static const char *fused[] = { "X Y","X Y :","X &","++ <= ?","? @<" };
+		int i;
+		for(i=0; i<EX_QUICK-EX_FUSE; ++i)
+			q_outv(0,"%s [%s]: %ld" STR_NL,_("Fused operator"),fused[i],ex_fused[i]);
+	}
 }
 
-static char *file_read(const char *file,int *len) {
-	int l = 0,r;
-	char *src = NULL;
-	FILE *fp = fopen(file,"rb");
-	if(fp) {
+/* Read a script file, mapped read-only when possible. A mapped script is
+ * not terminated by a zero, so it is only read within its length. */
+static str *file_map(const char *file) {
+	str *s = NULL;
+	char *src;
+	FILE *fp;
+	long l = 0,r;
+#ifdef __unix__
+	struct stat st;
+	void *p;
+	int fd = open(file,O_RDONLY);
+	if(fd<0) return NULL;
+	if(fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0 && st.st_size<LONG_MAX &&
+			(p=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0))!=MAP_FAILED) {
+		madvise(p,st.st_size,MADV_SEQUENTIAL); // Lexed front to back, so large scripts are paged in ahead and out behind
+		s = str_new_map((utf8_t *)p,(long)st.st_size);
+	}
+	close(fd);
+#endif
+	if(!s && (fp=fopen(file,"rb"))) {
 		fseek(fp,0,SEEK_END);
-		if((l=ftell(fp))>0) {
-			src = (char *)malloc(l+1);
+		if((l=ftell(fp))>0 && l<INT_MAX && (src=(char *)malloc(l+1))) {
 			fseek(fp,0,SEEK_SET);
 			r = fread(src,1,l,fp);
-			(void)r;
-			src[l] = '\0';
-if(verbose) q_outv(0,"%s [%d]:" STR_NL ANSI_COLOR_YELLOW "%s" ANSI_COLOR_VERBOSE STR_NL "EOF" STR_NL,_("Read file"),l,src);
+			s = str_new((utf8_t *)src,r>0? r : l);
 		}
 		fclose(fp);
 	}
-	if(len) *len = l;
-	return src;
+if(verbose && s) q_outv(0,"%s [%ld]:" STR_NL ANSI_COLOR_YELLOW "%.*s" ANSI_COLOR_VERBOSE STR_NL "EOF" STR_NL,_("Read file"),s->len,s->len<INT_MAX? (int)s->len : INT_MAX,(char *)s->data);
+	return s;
+}
+
+/* Included files are kept lexed, at most INCLUDE_CACHE of them with the
+ * last used first. An entry is found by device and inode, whatever path
+ * names the file, and the file is read again when its size or time of
+ * modification has changed. */
+#define INCLUDE_CACHE       64
+
+#ifdef __unix__
+typedef struct q_include q_include;
+
+struct q_include {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	q_script *script;
+	q_include *next;
+};
+
+static q_include *include_cache = NULL;
+#endif
+
+// Lexed script of an included file, holding a reference:
+static q_script *include_open(const char *file) {
+	q_script *sc = NULL;
+	str *s;
+	q_pos k;
+#ifdef __unix__
+	q_include *c,**p;
+	struct stat st;
+	int n;
+	if(stat(file,&st)!=0) return NULL;
+	for(p=&include_cache; (c=*p); p=&c->next)
+		if(c->dev==st.st_dev && c->ino==st.st_ino) {
+			*p = c->next;
+			if(c->size==st.st_size && c->mtime.tv_sec==st.st_mtim.tv_sec && c->mtime.tv_nsec==st.st_mtim.tv_nsec) {
+if(debug) q_outd(0,"OP_INCLUDE: cached: %s" STR_NL,file);
+				c->next = include_cache,include_cache = c;
+				++c->script->ref;
+				return c->script;
+			}
+			script_free(c->script),free(c); // Changed
+			break;
+		}
+#endif
+	if(file_image(file)) sc = q_image_open(file,0);
+	else if(!(s=file_map(file))) return NULL;
+	else {
+		k = file_skip(s->data,s->len);
+if(debug) q_outd(0,"OP_INCLUDE: len: %ld, src:" STR_NL "%.*s" STR_NL,s->len,s->len<INT_MAX? (int)s->len : INT_MAX,(char *)s->data);
+		if(s->len-k>0) sc = script_load(s,k);
+		str_free(s);
+	}
+#ifdef __unix__
+	if(sc && S_ISREG(st.st_mode) && (c=(q_include *)malloc(sizeof(q_include)))) {
+		*c = (q_include){ dev: st.st_dev, ino: st.st_ino, size: st.st_size, mtime: st.st_mtim, script: sc, next: include_cache };
+		include_cache = c,++sc->ref;
+		for(p=&include_cache,n=0; (c=*p) && ++n<=INCLUDE_CACHE; p=&c->next);
+		if(c) *p = NULL,script_free(c->script),free(c); // Least recently used
+	}
+#endif
+	return sc;
+}
+
+static void include_release() {
+#ifdef __unix__
+	q_include *c;
+	while((c=include_cache)) include_cache = c->next,script_free(c->script),free(c);
+#endif
+}
+
+// Compiled images are read by the name of the file:
+static int file_image(const char *file) {
+	size_t l = strlen(file);
+	return l>3 && !strcmp(&file[l-3],".qc");
+}
+
+// Position after a first line starting with "#!":
+static q_pos file_skip(const utf8_t *p,q_pos l) {
+	const utf8_t *q;
+	if(l<2 || p[0]!='#' || p[1]!='!') return 0;
+	if(!(q=memchr(p,'\n',l)) && !(q=memchr(p,'\r',l))) return l;
+	return q-p+1;
 }
 
 
@@ -938,9 +1229,37 @@ static int command(FILE *in,int tty,char *src,char *ln,int l) {
 
 #include "opt.c"
 
+// Lex a string, releasing it:
+static q_script *script_read(str *s,q_pos pos) {
+	q_script *sc = s->data && s->len>0? script_load(s,pos) : NULL;
+	str_free(s);
+	return sc;
+}
+
+static int emit_c(q_script *sc,const char *file,FILE *out) {
+	q_env *e = sc? q_open_script(sc,stdin,out,NULL) : NULL;
+	int r = e? q_emit_c(e,out,file) : 0;
+	script_free(sc);
+	q_close(e);
+	q_release();
+	return !r;
+}
+
+static int compile(q_script *sc,FILE *out) {
+	int r = sc? q_image_write(sc,out) : 0;
+	script_free(sc);
+	q_release();
+	return !r;
+}
+
 static opt opts[] = {
 	{   'd', "debug",    OPT_FLAG,  NULL, "execute with debugging" },
 	{ 0x101, "verbose",  OPT_FLAG,  NULL, "verbose output" },
+	{ 0x102, "jit",      OPT_FLAG,  NULL, "compile hot loops to native code" },
+	{ 0x103, "emit-c",   OPT_FLAG,  NULL, "write script as C source to stdout" },
+	{ 0x104, "flush",    OPT_STR,   "MODE", "flush output by line, block or full" },
+	{ 0x105, "compile",  OPT_FLAG,  NULL, "write script as compiled image to stdout, run when named .qc" },
+	{ 0x106, "cache",    OPT_STR,   "DIR", "keep compiled scripts in DIR, shared between processes" },
 	{   'v', "version",  OPT_FLAG,  NULL, "show program version" },
 	{   'h', "help",     OPT_FLAG,  NULL, "show this message" },
 {0}};
@@ -949,7 +1268,9 @@ int main(int argc,char **argv) {
 	FILE *in  = stdin;
 	FILE *out = stdout;
 	char *src;
-	int i,tty   = 1,len;
+	str *s = NULL;
+	q_script *sc = NULL;
+	int i,tty   = 1,len,emit = 0,image = 0;
 	opt *o;
 #ifdef __unix__
 	tty = isatty(0);
@@ -960,6 +1281,19 @@ int main(int argc,char **argv) {
 			switch(o->id) {
 				case 'd':debug = 1;break;
 				case 0x101:verbose = 1;break;
+				case 0x102:jit = 1;break;
+				case 0x103:emit = 1;break;
+				case 0x105:image = 1;break;
+				case 0x106:cache = o->s;break;
+				case 0x104:
+					     if(!strcmp(o->s,"line"))  flush = FLUSH_LINE;
+					else if(!strcmp(o->s,"block")) flush = FLUSH_BLOCK;
+					else if(!strcmp(o->s,"full"))  flush = FLUSH_FULL;
+					else {
+						fprintf(stderr,"%s: %s" STR_NL,_(ERR_FLUSH),o->s);
+						return 1;
+					}
+					break;
 				case 'v':
 					printf(_(USAGE_VERSION),PACKAGE_VERSION,PACKAGE_YEAR,PACKAGE_MAINTAINER);
 					return 0;
@@ -969,24 +1303,41 @@ int main(int argc,char **argv) {
 					printf(_(USAGE_FOOTER),PACKAGE_BUGREPORT,PACKAGE_NAME,PACKAGE_URL);
 					return 0;
 			}
-	if(argc>=2 && (in=fopen(argv[argc-1],"rb"))==NULL) {
+	if(argc>=2 && file_image(argv[argc-1])) {
+		if((sc=q_image_open(argv[argc-1],0))==NULL) {
+			fprintf(stderr,"%s: %s" STR_NL,(in=fopen(argv[argc-1],"rb"))? _(ERR_IMAGE) : _(ERR_FILE_IN),argv[argc-1]);
+			if(in) fclose(in);
+			return 1;
+		}
+	} else if(argc>=2 && (s=file_map(argv[argc-1]))==NULL && (in=fopen(argv[argc-1],"rb"))==NULL) {
 		fprintf(stderr,"%s: %s" STR_NL,_(ERR_FILE_IN),argv[argc-1]);
 		return 1;
 	}
 	cli_init();
+	if(s) sc = script_read(s,file_skip(s->data,s->len)); // Script files are run from the mapping
+	if(sc) {
+		if(emit) return emit_c(sc,argv[argc-1],out);
+		if(image) return compile(sc,out);
+		run(sc,stdin,out);
+		if(out==stdout && newline) q_outc(EOF,out);
+		return 0;
+	}
 	if(in==stdin && tty)
 		fprintf(out,_(INT_MOD_HEADER),PACKAGE_VERSION);
 	if(in!=stdin || !tty) {
 		src = cli_read(in,tty,&len);
 		if(in!=stdin) fclose(in);
 		if(src!=NULL && len>0) {
-			run(src,len,stdin,out);
+			sc = script_read(str_new((utf8_t *)src,len),0);
+			if(emit) return emit_c(sc,argc>=2? argv[argc-1] : "stdin",out);
+			if(image) return compile(sc,out);
+			run(sc,stdin,out);
 			if(out==stdout && newline) q_outc(EOF,out);
 		}
 	} else {
 		while(1) {
 			if((src=cli_read(in,tty,&len))!=NULL && len>0) {
-				run(src,len,stdin,out);
+				run(script_read(str_new((utf8_t *)src,len),0),stdin,out);
 				if(out==stdout && newline) q_outc(EOF,out);
 			}
 		}
@@ -53,10 +53,58 @@ enum {
 
 extern int debug;
 extern int verbose;
+extern int jit;
 extern int newline;
 
 extern int op[];
 extern int arop[];
+extern int ex_op[];
+extern long ex_fused[];
+
+#define op_combine(a,b) arop[((a)&0xff)*17+((b)&0xff)-18]
+
+typedef long q_pos;   // Position in source, 64-bit so scripts may be over 2GB
+
+typedef struct q_token q_token;
+
+struct q_token {
+	int op;     // Operator
+	int len;    // Length in source
+	q_pos pos;  // Position in source
+	int arg;    // Variable index, constant index (strings with inserted variables: ~template index), length of direct text, or 1 if operator is followed by a constant
+	int jmp;    // Blocks: index of matching close, if and else: index of token to continue after
+	int code;   // Execution code
+	int type;   // Types of operands when quickening, or -1 if types have changed
+};
+
+typedef struct q_seg q_seg;
+
+struct q_seg {
+	q_pos pos;  // Position of text in source
+	int len;    // Length of text
+	int var;    // Variable inserted after text, VARS for Vt, or -1 for end of template
+};
+
+typedef struct q_ir q_ir;
+
+struct q_ir {
+	int op;     // IR_*
+	int tok;    // Index of token compiled to instruction
+	int d;      // Register written, 0-21 variables, VARS Vt, VARS+1 to VARS+3 V0-V2 at start of run
+	int a;      // Register read, or constant index
+	int b;      // Register read
+	int v[3];   // Registers in V0-V2 before the token, to continue in the interpreter
+};
+
+typedef struct q_irb q_irb;
+
+struct q_irb {
+	int tok;    // Index of first token of run
+	int end;    // Index of last token of run
+	int ir;     // Index of first instruction
+	int ir_len;
+	int v[3];   // Registers in V0-V2 after the run
+};
 
 
 typedef struct q_block q_block;
@@ -72,13 +120,77 @@ struct q_block {
 	int expr_state;
 };
 
+typedef struct q_script q_script;
 typedef struct q_env q_env;
+typedef struct q_jit q_jit;
+typedef struct q_writer q_writer;
+typedef struct q_reader q_reader;
+
+#define WRITER_BUF 65536 // Size of output buffer
+#define READER_BUF 65536 // Size of input buffer
+
+enum {
+	FLUSH_LINE,         // Flush at end of each line
+	FLUSH_BLOCK,        // Flush when the buffer is full
+	FLUSH_FULL          // Flush at end of script and before input only
+};
+
+// Buffered output, shared by an environment and the environments it opens:
+struct q_writer {
+	FILE *fp;
+	int flush;          // Flush policy
+	utf8_t *buf;
+	int len;
+	int cap;
+	q_writer *next;     // Open writers, flushed before messages
+};
+
+// Buffered input, shared like the writer; long lines are views of the buffer:
+struct q_reader {
+	FILE *fp;
+	str *buf;           // Read buffer, replaced while views of it are in use
+	int pos;            // Start of unread data
+	int len;            // End of read data
+	int eof;
+};
+
+// Lexed source, shared by the environments running it:
+struct q_script {
+	int ref;
+	int image;    // Set when read from a compiled image, which is held by src_s and holds all but the constants
+	utf8_t *src;
+	str *src_s;
+	q_pos len;
+	q_pos pos;    // Position lexed from
+	q_token *tok;
+	int tok_len;
+	var *cst;
+	int cst_len;
+	q_seg *seg;
+	int *tpl;
+	int tpl_len;
+	q_ir *ir;
+	int ir_len;
+	q_irb *irb;
+	int irb_len;
+};
 
 struct q_env {
 	q_env *parent;
+	q_script *script; // Owner of the lexed source, the fields below are copied from it
 	utf8_t *src;
-	int len;
-	int pos;
+	str *src_s;   // String holding the source
+	q_pos len;
+	q_token *tok;
+	int tok_len;
+	var *cst;     // Constant pool, numbers and strings parsed by the lexer
+	int cst_len;
+	q_seg *seg;   // Template segments of strings with inserted variables
+	int *tpl;     // Index of first segment for each template
+	int tpl_len;
+	utf8_t *buf;  // Scratch buffer for rendering templates
+	int buf_cap;
+	int pos;      // Index of current token
 	q_block *stack;
 	int stack_index;
 	q_block *b0;
@@ -90,6 +202,15 @@ struct q_env {
 	var vt;
 	FILE *in;
 	FILE *out;
+	q_writer *wr; // Buffered output to out
+	q_reader *rd; // Buffered input from in
+	q_jit *jit;   // Compiled blocks, when running with --jit
+	q_ir *ir;     // Instructions of compiled runs of tokens
+	int ir_len;
+	q_irb *irb;
+	int irb_len;
+	int ir_fold;  // Number of folded instructions
+	int ir_dead;  // Number of removed instructions
 };
 
 enum {
@@ -193,24 +314,97 @@ enum {
 	OP_CCLOSE  =  0x1FFF,  // */   ... */
 };
 
+enum {
+/* Execution codes, a dense numbering of the operators used for dispatch.
+ * ex_op maps each code to its operator. */
+	EX_NONE,
+	EX_ADD,     EX_SUB,     EX_MUL,     EX_DIV,     EX_MOD,     EX_INDEX,
+	EX_OUTPUT,  EX_SET,     EX_IF,      EX_EQ,      EX_NIS,     EX_LT,
+	EX_GT,      EX_GOTO,    EX_CARET,   EX_ELSE,    EX_NOT,     EX_LEXPR,
+	EX_REXPR,   EX_LBLOCK,  EX_RBLOCK,  EX_NUM,     EX_STR,     EX_VAR,
+	EX_INT,     EX_FLOAT,   EX_ADD2,    EX_SUB2,    EX_MUL2,    EX_DIV2,
+	EX_MOD2,    EX_INC,     EX_DEC,     EX_POW,     EX_SQRT,    EX_LSHIFT,
+	EX_RSHIFT,  EX_AND,     EX_OR,      EX_XOR,     EX_LSHIFT2, EX_RSHIFT2,
+	EX_AND2,    EX_OR2,     EX_XOR2,    EX_NOT2,    EX_ABS,     EX_NEG,
+	EX_FLOOR,   EX_CEIL,    EX_INT2,    EX_RED,     EX_NIF,     EX_IS,
+	EX_NEQ,     EX_LTEQ,    EX_GTEQ,    EX_ELVIS,   EX_ELVIS2,  EX_INPUT,
+	EX_DOUT,    EX_DOUTE,   EX_DSTR,    EX_DSTRE,   EX_POS,     EX_LOOP,
+	EX_RETURN,  EX_INCLUDE, EX_EXEC,    EX_COPEN,   EX_CCLOSE,
+	// Fused operators, set by the lexer on the first token of a sequence:
+	EX_FUSE,
+	EX_VAR2 = EX_FUSE,  // X Y
+	EX_VAR2_SET,        // X Y :
+	EX_VAR_OUTPUT,      // X &
+	EX_INC_CMP_IF,      // ++ <= ?
+	EX_IF_LOOP,         // ? @<
+	// Quickened operators, set when executing for operands of the same types:
+	EX_QUICK,
+	EX_ADD_II = EX_QUICK,
+	EX_ADD_FF,  EX_SUB_II,  EX_SUB_FF,  EX_MUL_II,  EX_MUL_FF,  EX_DIV_II,
+	EX_DIV_FF,  EX_MOD_II,  EX_CMP_II,
+	EX_IR,              // Compiled run of tokens, jmp is index of run
+	EX_LEN
+};
+
 void q_outv(int nl,const char *f, ...);
 void q_outd(int nl,const char *f, ...);
 void q_oute(int nl,const char *f, ...);
 
 void q_outc(int c,FILE *out);
-void q_out_utf8(utf8_t **p,FILE *out);
 
-int q_str_len(q_env *e,const utf8_t *p);
-void q_var_str(q_env *e,var *v,const utf8_t *p,int *q);
+q_writer *q_writer_open(FILE *fp,int flush);
+void q_writer_close(q_writer *w);
+void q_flush(q_writer *w);
+void q_write(q_writer *w,const utf8_t *p,int l);
+void q_outw(int c,q_writer *w);
+q_reader *q_reader_open(FILE *fp);
+void q_reader_close(q_reader *r);
+str *q_read_line(q_reader *r,int l);
+
+void q_var_tpl(q_env *e,var *v,int n);
 
 void q_input(q_env *e,var *v,int l);
 void q_output(q_env *e,var *v);
 
-void q_block_end(q_env *e,int f,int r);
+int q_lex(q_env *e,q_pos pos);
+int q_code(int o);
+
+int q_jit_loop(q_env *e);
+void q_jit_free(q_env *e);
+
+enum {
+	IR_NOP,
+	IR_NUM,     // d = cst[a]
+	IR_SET,     // d = a
+	IR_ADD,     // d = a + b
+	IR_SUB,
+	IR_MUL,
+	IR_DIV,
+	IR_MOD,
+	IR_INC,     // d++
+	IR_DEC,
+};
+
+#define IR_VT               VARS        // Registers: the variables, Vt, and V0-V2 at the start of a run
+#define IR_V0               (VARS+1)
+#define IR_REGS             (VARS+4)
+
+int q_ir_compile(q_env *e);
+
+int q_emit_c(q_env *e,FILE *out,const char *file);
+int q_image_write(q_script *sc,FILE *out);
+q_script *q_image_open(const char *file,int own);
+int q_image_dir(const char *dir);
+int q_image_name(char *file,int n,const char *dir,str *s,q_pos pos);
+int q_image_publish(q_script *sc,const char *file);
+int q_ir_exec(q_env *e,q_irb *b);
+
 
 void q_exec(q_env *e);
 
 q_env *q_open(char *src,int pos,int len,FILE *in,FILE *out,q_env *pe);
+q_env *q_open_str(str *s,q_pos pos,FILE *in,FILE *out,q_env *pe);
+q_env *q_open_script(q_script *sc,FILE *in,FILE *out,q_env *pe);
 q_env *q_close(q_env *e);
 
 #endif /* _Q_Q_H_ */
@@ -0,0 +1,275 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Q language compiled scripts; operators as functions
+ *
+ * This file is included by the C source written with "q --emit-c",
+ * which is compiled with io.c, var.c and str.c. Each function does
+ * what the interpreter does for the operator in q_exec, with V0-V2
+ * resolved by the caller.
+ *
+ * The semantics must stay the same as in q_exec (q.c): arithmetic on ints
+ * and floats with ints widened, comparisons through var_cmp, whose result
+ * is truncated to int, and + joining when either operand is a string.
+ * Change both together.
+ */
+#ifndef _Q_QC_H_
+#define _Q_QC_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "q.h"
+#include "var.h"
+#include "str.h"
+
+#define qc_inline static inline __attribute__((always_inline))
+#define qc_static static __attribute__((unused))
+#define qc_unused __attribute__((unused))
+
+// String of V0 before an operator that writes to V0, freed after if V0 changed:
+#define qc_s0(e,v0) ((v0)->type==STR && (v0)==(e)->v0? (v0)->s : NULL)
+#define qc_s1(s,v0) if((s) && ((v0)->type!=STR || (v0)->s!=(s))) str_free(s)
+
+qc_static void qc_open(q_env *e,q_block *stack,var *va,int n) {
+	int i;
+	for(i=0; i<STACK; ++i)
+		stack[i] = (q_block){
+			index:      i,
+			pos:        -1,
+			end:        n-1,
+			end_block:  0,
+			ret:        n-1,
+			ret_block:  0,
+			expr:       -1,
+			expr_state: EXPR_AND
+		};
+	for(i=0; i<VARS; ++i)
+		va[i] = (var){ index: i, type: VOID, i: 0 };
+	e->stack = stack,e->b0 = &stack[0],e->stack_index = 0;
+	e->va = va,e->va_len = VARS;
+	e->v0 = e->v1 = e->v2 = &va[ALEPH];
+	e->vt = (var){ index: 0, type: VOID, i: 0 };
+	e->pos = -1;
+}
+
+qc_static var qc_str(const char *p,int l) {
+	return (var){ index: 0, type: STR, s: str_new_dup((const utf8_t *)p,l) };
+}
+
+qc_inline void qc_add(var *v0,var *v2,var *v1) {
+	     if(v1->type==STR   || v2->type==STR)   v0->s = var_join(v0,v2,v1),            v0->type = STR;
+	else if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         + v1->f,         v0->type = FLOAT;
+	else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i + v1->f,         v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         + (double)v1->i, v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         + v1->i,         v0->type = INT;
+}
+
+qc_inline void qc_sub(var *v0,var *v2,var *v1) {
+	     if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         - v1->f,         v0->type = FLOAT;
+	else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i - v1->f,         v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         - (double)v1->i, v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         - v1->i,         v0->type = INT;
+}
+
+qc_inline void qc_mul(var *v0,var *v2,var *v1) {
+	     if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         * v1->f,         v0->type = FLOAT;
+	else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i * v1->f,         v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         * (double)v1->i, v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         * v1->i,         v0->type = INT;
+}
+
+qc_inline void qc_div(var *v0,var *v2,var *v1) {
+	     if(v1->type==FLOAT && v2->type==FLOAT) v0->f = v2->f         / v1->f,         v0->type = FLOAT;
+	else if(v1->type==FLOAT && v2->type==INT)   v0->f = (double)v2->i / v1->f,         v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==FLOAT) v0->f = v2->f         / (double)v1->i, v0->type = FLOAT;
+	else if(v1->type==INT   && v2->type==INT)   v0->i = v2->i         / v1->i,         v0->type = INT;
+}
+
+qc_inline void qc_mod(var *v0,var *v2,var *v1) {
+	double f;
+	if(v1->type==FLOAT || v2->type==FLOAT) {
+		     if(v1->type==FLOAT && v2->type==FLOAT) v0->f = modf(v2->f/v1->f,&f),         v0->type = FLOAT;
+		else if(v1->type==INT)                     v0->f = modf(v2->f/(double)v1->i,&f), v0->type = FLOAT;
+		else if(v2->type==INT)                     v0->f = modf((double)v2->i/v1->f,&f), v0->type = FLOAT;
+	} else if(v1->type==INT && v2->type==INT)     v0->i = v2->i % v1->i,                v0->type = INT;
+}
+
+qc_inline void qc_pow(var *v0,var *v2,var *v1) {
+	     if(v1->type==FLOAT && v2->type==FLOAT) v0->f = pow(v2->f,v1->f),              v0->type = FLOAT;
+	else if(v1->type==FLOAT && v2->type==INT)   v0->f = pow((double)v2->i,v1->f),      v0->type = FLOAT;
+	else if(v1->type==INT && v2->type==FLOAT)   v0->f = pow(v2->f,(double)v1->i),      v0->type = FLOAT;
+	else if(v1->type==INT && v2->type==INT)     v0->f = var_ipow(v2->i,v1->i),         v0->type = INT;
+}
+
+qc_inline void qc_sqrt(var *v0,var *v1) {
+	     if(v1->type==FLOAT)                    v0->f = sqrt(v1->f),                   v0->type = FLOAT;
+	else if(v1->type==INT)                      v0->i = var_isqrt(v1->i),              v0->type = INT;
+}
+
+// Shift, and, or, xor:
+qc_inline void qc_bits(int o,var *v0,var *v2,var *v1) {
+	if(v1->type!=INT || v2->type!=INT) return;
+	switch(o&0xff) {
+		case 1:v0->i = (v2->i << v1->i);break;
+		case 2:v0->i = (v2->i >> v1->i);break;
+		case 3:v0->i = (v2->i &  v1->i);break;
+		case 4:v0->i = (v2->i |  v1->i);break;
+		default:v0->i = (v2->i ^  v1->i);break;
+	}
+	v0->type = INT;
+}
+
+qc_inline void qc_int(var *v0,var *v1) {
+	char *p;
+	if(v1->type==STR) {
+		if(str_is_int(v1->s))   v0->i = strtol((char *)str_data(v1->s),&p,0), v0->type = INT;
+		else                    v0->i = str_val_sum(v1->s,0),                 v0->type = INT;
+	} else if(v1->type==FLOAT) v0->i = (long)v1->f,                          v0->type = INT;
+	  else if(v1->type==INT)   v0->i = var_ired(v1->i,10),                   v0->type = INT;
+}
+
+qc_inline void qc_float(var *v0,var *v1) {
+	     if(v0->type==FLOAT)   v0->f = round(v1->f);
+	else if(v0->type==INT)     v0->f = (double)v1->i,                        v0->type = FLOAT;
+}
+
+qc_inline void qc_red(var *v0,var *v2,var *v1) {
+	     if(v2->type==STR && v1->type==INT) v0->i = var_ired(str_val_sum(v2->s,0),v1->i), v0->type = INT;
+	else if(v2->type==INT && v1->type==INT) v0->i = var_ired(v2->i,v1->i),                v0->type = INT;
+}
+
+qc_inline int qc_cmp(int o,var *v0,var *v1) {
+	     if(o==OP_IS)   return !var_empty(v0);
+	else if(o==OP_NIS)  return var_empty(v0);
+	else if(o==OP_EQ)   return var_eq(v0,v1);
+	else if(o==OP_NEQ)  return !var_eq(v0,v1);
+	else if(o==OP_LT)   return var_cmp(v0,v1)<0;
+	else if(o==OP_GT)   return var_cmp(v0,v1)>0;
+	else if(o==OP_LTEQ) return var_cmp(v0,v1)<=0;
+	else                return var_cmp(v0,v1)>=0;
+}
+
+qc_inline void qc_expr(q_env *e,int a) {
+	if(e->b0->expr==-1) e->b0->expr = a;
+	else if(e->b0->expr_state==EXPR_AND) e->b0->expr = (e->b0->expr && a);
+	else if(e->b0->expr_state==EXPR_OR)  e->b0->expr = (e->b0->expr || a);
+}
+
+// Condition of if-operator, resetting the expression:
+qc_inline int qc_if(q_env *e) {
+	int a = e->b0->expr;
+	e->b0->expr = -1;
+	return a;
+}
+
+qc_static int qc_lexpr(q_env *e) {
+	q_block *b1;
+	if(e->stack_index+1==STACK) return 0;
+	b1 = &e->stack[++e->stack_index];
+	*b1 = *e->b0;
+	b1->expr = -1;
+	if(e->b0->expr_state==EXPR_AND)     b1->expr_state = EXPR_OR;
+	else if(e->b0->expr_state==EXPR_OR) b1->expr_state = EXPR_AND;
+	e->b0 = b1;
+	return 1;
+}
+
+// Returns 0 at the end of the script:
+qc_static int qc_rexpr(q_env *e) {
+	q_block *b1;
+	if(e->stack_index<=0) return 0;
+	b1 = &e->stack[--e->stack_index];
+	if(e->b0->expr!=-1) {
+		if(b1->expr==-1) b1->expr = e->b0->expr;
+		else if(b1->expr_state==EXPR_AND) b1->expr = (b1->expr && e->b0->expr);
+		else if(b1->expr_state==EXPR_OR)  b1->expr = (b1->expr || e->b0->expr);
+	}
+	e->b0 = b1;
+	return 1;
+}
+
+qc_static int qc_lblock(q_env *e,int i) {
+	q_block *b1;
+	if(e->stack_index+1==STACK) return 0;
+	b1 = &e->stack[++e->stack_index];
+	b1->pos         = i;
+	b1->end         = i; // Continue after end of block
+	b1->end_block   = e->b0->index;
+	b1->ret         = e->b0->ret;
+	b1->ret_block   = e->b0->ret_block;
+	b1->expr        = -1;
+	b1->expr_state  = EXPR_AND;
+	e->b0 = b1;
+	return 1;
+}
+
+// Returns the token to continue after, or -1 to continue with the next token:
+qc_inline int qc_rblock(q_env *e) {
+	q_block *b1 = &e->stack[e->b0->end_block];
+	int a = e->b0->end!=e->b0->pos? e->b0->end : -1;
+	e->stack_index = b1->index;
+	e->b0 = b1;
+	return a;
+}
+
+/* Call the block at the position in V0, where pos holds the position of
+ * each of the n tokens. Returns the token to continue after, or -2 on
+ * stack overflow. */
+qc_static int qc_goto(q_env *e,var *v0,const q_pos *pos,int n,int i) {
+	q_block *b1;
+	q_pos a = var_int(v0);
+	int j = 0,m;
+	if(a<0) a = -1;
+	else if(a>=e->len) a = e->len-1;
+	while(j<n) {
+		m = (j+n)>>1;
+		if(pos[m]<=a) j = m+1;
+		else n = m;
+	}
+	a = j-1;
+	if(e->stack_index+1==STACK) return -2;
+	b1 = &e->stack[++e->stack_index];
+	b1->pos         = a;
+	b1->end         = i; // Return after end of block
+	b1->end_block   = e->b0->index;
+	b1->ret         = i; // Return on return operator
+	b1->ret_block   = e->b0->index;
+	b1->expr        = -1;
+	b1->expr_state  = EXPR_AND;
+	e->b0 = b1;
+	return a;
+}
+
+// Returns the token to continue after:
+qc_inline int qc_return(q_env *e) {
+	int a = e->b0->ret;
+	e->b0 = &e->stack[e->b0->ret_block];
+	return a;
+}
+
+qc_static void qc_dout(q_env *e,q_pos p,int l) {
+	int c;
+	if(l<=0) return;
+	q_write(e->wr,&e->src[p],l);
+	c = e->src[p+l-1];
+	newline = c!='\n' && c!='\r';
+}
+
+#endif /* _Q_QC_H_ */
@@ -18,6 +18,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
 #include "q.h"
 #include "str.h"
 
@@ -36,11 +40,21 @@ int utf8_decode(const utf8_t *s,int *i) {
 	return u;
 }
 
-// Unicode Hebrew to Latin:
-int uh2l[] = {'A','B','G','D','H','V',
-              'Z','X','J','I','K','K','L',
-              'M','M','N','N','S','E','P','P','C','C',
-              'Q','R','F','T' };
+// Length of the well-formed UTF-8 character at s, or 0 if invalid or cut at n:
+int utf8_valid(const utf8_t *s,long n) {
+	int c = s[0];
+	if(c<0x80) return 1;
+	if(c<0xc2 || c>0xf4) return 0; // Continuation byte, overlong, or above U+10FFFF
+	if(c<0xe0) return n>=2 && (s[1]&0xc0)==0x80? 2 : 0;
+	if(c<0xf0) {
+		if(n<3 || (s[1]&0xc0)!=0x80 || (s[2]&0xc0)!=0x80) return 0;
+		if((c==0xe0 && s[1]<0xa0) || (c==0xed && s[1]>=0xa0)) return 0; // Overlong, or surrogate
+		return 3;
+	}
+	if(n<4 || (s[1]&0xc0)!=0x80 || (s[2]&0xc0)!=0x80 || (s[3]&0xc0)!=0x80) return 0;
+	if((c==0xf0 && s[1]<0x90) || (c==0xf4 && s[1]>=0x90)) return 0;
+	return 4;
+}
 
 // Hebrew to Latin:
 int h2l[]  = {'A','B','G','D','H','W',
@@ -69,11 +83,72 @@ int lval[]  = {  1,  2, 90,  4, 70,300,  3,  5, 10, /* A-I */
                 60,400,  6,  6,  6,  8, 10,  7 };   /* S-Z */
 
 
+/* Letters of the two byte UTF-8 characters, by page of 64 code points:
+ * utf8_page[] gives the page of a lead byte, and the low six bits of the
+ * second byte the letter. Page 0 holds no letters. Greek letters have the
+ * isopsephy and arabic letters the abjad values, each taking the variable
+ * of the hebrew letter it derives from. Hebrew letters have value 0, for
+ * the value of the latin letter. */
+#define L(u,l,v,n) [(u)&0x3f] = { latin: l, var: v, value: n }
+
+const utf8_letter utf8_table[][64] = {
+	{ { 0 } },
+	{ // U+0380-U+03BF, Greek
+		L(0x391,'A',ALEPH,  1),L(0x392,'B',BETH,   2),L(0x393,'G',GIMEL,  3),L(0x394,'D',DALETH, 4),
+		L(0x395,'H',HEH,    5),L(0x396,'Z',ZAIN,   7),L(0x397,'X',CHETH,  8),L(0x398,'J',TETH,   9),
+		L(0x399,'I',YOD,   10),L(0x39a,'K',KAPH,  20),L(0x39b,'L',LAMED, 30),L(0x39c,'M',MEM,   40),
+		L(0x39d,'N',NUN,   50),L(0x39e,'S',SAMEKH,60),L(0x39f,'E',AYIN,  70),L(0x3a0,'P',PEH,   80),
+		L(0x3a1,'R',RESH, 100),L(0x3a3,'F',SHIN, 200),L(0x3a4,'T',TAU,  300),L(0x3a5,'W',VAV,  400),
+		L(0x3a6,'P',PEH,  500),L(0x3a7,'X',CHETH,600),L(0x3a8,'S',SAMEKH,700),L(0x3a9,'E',AYIN, 800),
+		L(0x3b1,'A',ALEPH,  1),L(0x3b2,'B',BETH,   2),L(0x3b3,'G',GIMEL,  3),L(0x3b4,'D',DALETH, 4),
+		L(0x3b5,'H',HEH,    5),L(0x3b6,'Z',ZAIN,   7),L(0x3b7,'X',CHETH,  8),L(0x3b8,'J',TETH,   9),
+		L(0x3b9,'I',YOD,   10),L(0x3ba,'K',KAPH,  20),L(0x3bb,'L',LAMED, 30),L(0x3bc,'M',MEM,   40),
+		L(0x3bd,'N',NUN,   50),L(0x3be,'S',SAMEKH,60),L(0x3bf,'E',AYIN,  70)
+	},
+	{ // U+03C0-U+03FF, Greek
+		L(0x3c0,'P',PEH,   80),L(0x3c1,'R',RESH, 100),L(0x3c2,'F',SHIN, 200),L(0x3c3,'F',SHIN, 200),
+		L(0x3c4,'T',TAU,  300),L(0x3c5,'W',VAV,  400),L(0x3c6,'P',PEH,  500),L(0x3c7,'X',CHETH,600),
+		L(0x3c8,'S',SAMEKH,700),L(0x3c9,'E',AYIN, 800),
+		L(0x3d8,'Q',QOPH,  90),L(0x3d9,'Q',QOPH,  90),L(0x3da,'W',VAV,    6),L(0x3db,'W',VAV,    6), // Koppa, stigma
+		L(0x3dc,'W',VAV,    6),L(0x3dd,'W',VAV,    6),L(0x3de,'Q',QOPH,  90),L(0x3df,'Q',QOPH,  90), // Digamma, koppa
+		L(0x3e0,'C',TZADDI,900),L(0x3e1,'C',TZADDI,900)                                              // Sampi
+	},
+	{ // U+05C0-U+05FF, Hebrew
+		L(0x5d0,'A',ALEPH,  0),L(0x5d1,'B',BETH,   0),L(0x5d2,'G',GIMEL,  0),L(0x5d3,'D',DALETH, 0),
+		L(0x5d4,'H',HEH,    0),L(0x5d5,'V',VAV,    0),L(0x5d6,'Z',ZAIN,   0),L(0x5d7,'X',CHETH,  0),
+		L(0x5d8,'J',TETH,   0),L(0x5d9,'I',YOD,    0),L(0x5da,'K',KAPH,   0),L(0x5db,'K',KAPH,   0),
+		L(0x5dc,'L',LAMED,  0),L(0x5dd,'M',MEM,    0),L(0x5de,'M',MEM,    0),L(0x5df,'N',NUN,    0),
+		L(0x5e0,'N',NUN,    0),L(0x5e1,'S',SAMEKH, 0),L(0x5e2,'E',AYIN,   0),L(0x5e3,'P',PEH,    0),
+		L(0x5e4,'P',PEH,    0),L(0x5e5,'C',TZADDI, 0),L(0x5e6,'C',TZADDI, 0),L(0x5e7,'Q',QOPH,   0),
+		L(0x5e8,'R',RESH,   0),L(0x5e9,'F',SHIN,   0),L(0x5ea,'T',TAU,    0)
+	},
+	{ // U+0600-U+063F, Arabic
+		L(0x621,'A',ALEPH,  1),L(0x622,'A',ALEPH,  1),L(0x623,'A',ALEPH,  1),L(0x624,'W',VAV,    6), // Hamza
+		L(0x625,'A',ALEPH,  1),L(0x626,'I',YOD,   10),L(0x627,'A',ALEPH,  1),L(0x628,'B',BETH,   2),
+		L(0x629,'H',HEH,    5),L(0x62a,'T',TAU,  400),L(0x62b,'T',TAU,  500),L(0x62c,'G',GIMEL,  3),
+		L(0x62d,'X',CHETH,  8),L(0x62e,'X',CHETH,600),L(0x62f,'D',DALETH, 4),L(0x630,'D',DALETH,700),
+		L(0x631,'R',RESH, 200),L(0x632,'Z',ZAIN,   7),L(0x633,'S',SAMEKH,60),L(0x634,'F',SHIN, 300),
+		L(0x635,'C',TZADDI,90),L(0x636,'C',TZADDI,800),L(0x637,'J',TETH,   9),L(0x638,'J',TETH, 900),
+		L(0x639,'E',AYIN,  70),L(0x63a,'E',AYIN,1000)
+	},
+	{ // U+0640-U+067F, Arabic
+		L(0x641,'P',PEH,   80),L(0x642,'Q',QOPH, 100),L(0x643,'K',KAPH,  20),L(0x644,'L',LAMED, 30),
+		L(0x645,'M',MEM,   40),L(0x646,'N',NUN,   50),L(0x647,'H',HEH,    5),L(0x648,'W',VAV,    6),
+		L(0x649,'I',YOD,   10),L(0x64a,'I',YOD,   10)
+	}
+};
+
+const unsigned char utf8_page[256] = { [0xce] = 1, [0xcf] = 2, [0xd7] = 3, [0xd8] = 4, [0xd9] = 5 };
+
+#undef L
+
+
 str *str_new(utf8_t *s,int l) {
 	str *r = malloc(sizeof(str));
-	r->ref = 1,r->data = NULL,r->len = 0;
+	r->ref = 1,r->data = NULL,r->len = 0,r->cap = 0,r->flags = 0,r->hash = 0,r->parent = NULL;
 	if(s) {
 		r->len = l>0? l : strlen((char *)s);
+		r->cap = r->len+1;
 		r->data = s;
 		r->data[r->len] = '\0';
 	}
@@ -83,10 +158,11 @@ str *str_new(utf8_t *s,int l) {
 
 str *str_new_dup(const utf8_t *s,int l) {
 	str *r = malloc(sizeof(str));
-	r->ref = 1,r->data = NULL,r->len = 0;
+	r->ref = 1,r->data = NULL,r->len = 0,r->cap = 0,r->flags = 0,r->hash = 0,r->parent = NULL;
 	if(s) {
 		r->len = l>0? l : strlen((char *)s);
-		r->data = (utf8_t *)malloc(r->len+1);
+		if(r->len<STR_INLINE_LEN) r->data = r->buf,r->cap = STR_INLINE_LEN,r->flags = STR_INLINE;
+		else r->data = (utf8_t *)malloc(r->cap=r->len+1);
 		memcpy(r->data,s,r->len);
 		r->data[r->len] = '\0';
 	}
@@ -94,10 +170,126 @@ str *str_new_dup(const utf8_t *s,int l) {
 	return r;
 }
 
+// String of a file mapped by mmap, unmapped when freed:
+str *str_new_map(utf8_t *s,long l) {
+	str *r = str_new(NULL,0);
+	r->data = s,r->len = l,r->flags = STR_MAP;
+	return r;
+}
+
+// View of l bytes of s from i, sharing the data:
+str *str_view(str *s,long i,int l) {
+	str *r = malloc(sizeof(str));
+	if(s->flags&STR_VIEW) i += s->data-s->parent->data,s = s->parent;
+	*r = (str){ ref: 1, data: &s->data[i], len: l, cap: 0, flags: STR_VIEW, hash: 0, parent: str_dup(s) };
+	return r;
+}
+
+// Copy the data of a view or a mapping, releasing the parent:
+utf8_t *str_cstr(str *s) {
+	utf8_t *p = s->buf;
+	if(!(s->flags&(STR_VIEW|STR_MAP))) return s->data;
+	if(s->len>=STR_INLINE_LEN && !(p=(utf8_t *)malloc(s->len+1))) return NULL;
+	memcpy(p,s->data,s->len);
+	p[s->len] = '\0';
+	if(s->flags&STR_VIEW) str_free(s->parent);
+#ifdef __unix__
+	else munmap(s->data,s->len);
+#endif
+	s->data = p,s->parent = NULL,s->flags &= ~(STR_VIEW|STR_MAP);
+	if(p==s->buf) s->cap = STR_INLINE_LEN,s->flags |= STR_INLINE;
+	else s->cap = s->len+1;
+	return p;
+}
+
+/* Intern table of strings by content, open addressing with linear probing.
+ * The table holds no reference; strings are removed when freed. */
+static str **intern = NULL;
+static int intern_cap = 0,intern_len = 0;
+
+static unsigned str_hash_data(const utf8_t *p,int l) {
+	unsigned h = 2166136261u; // FNV-1a, to the terminating zero as strcmp
+	for(; l-- && *p; ++p) h = (h^*p)*16777619u;
+	return h? h : 1;
+}
+
+static void str_unintern(str *s) {
+	int i,j,k,m = intern_cap-1;
+	for(i=s->hash&m; intern[i]!=s; i=(i+1)&m);
+	for(j=i; intern[j=(j+1)&m]; ) { // Shift following entries back into the gap
+		k = intern[j]->hash&m;
+		if((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j)) intern[i] = intern[j],i = j;
+	}
+	intern[i] = NULL,--intern_len;
+}
+
+static void intern_grow() {
+	int i,j,n = intern_cap? intern_cap*2 : 256;
+	str **t = (str **)calloc(n,sizeof(str *));
+	for(i=0; i<intern_cap; ++i)
+		if(intern[i]) {
+			for(j=intern[i]->hash&(n-1); t[j]; j=(j+1)&(n-1));
+			t[j] = intern[i];
+		}
+	free(intern);
+	intern = t,intern_cap = n;
+}
+
+static str *str_intern_new(str *v,const utf8_t *s,int l) {
+	unsigned h;
+	int i;
+	str *r;
+	if(l<=0) return str_new_dup((const utf8_t *)"",0); // Not by str_new_dup(s,0), which takes the length of s
+	if(memchr(s,'\0',l)) return v? str_view(v,s-v->data,l) : str_new_dup(s,l); // Not comparable as by strcmp
+	if(intern_len*2>=intern_cap) intern_grow();
+	h = str_hash_data(s,l);
+	for(i=h&(intern_cap-1); (r=intern[i]); i=(i+1)&(intern_cap-1))
+		if(r->hash==h && r->len==l && !memcmp(r->data,s,l)) return str_dup(r);
+	r = v? str_view(v,s-v->data,l) : str_new_dup(s,l);
+	r->hash = h,r->flags |= STR_INTERN;
+	intern[i] = r,++intern_len;
+	return r;
+}
+
+str *str_intern(const utf8_t *s,int l) {
+	return str_intern_new(NULL,s,l);
+}
+
+// As str_intern, but a new string is a view of s:
+str *str_intern_view(str *s,long i,int l) {
+	return str_intern_new(s,&s->data[i],l);
+}
+
+unsigned str_hash(str *s) {
+	if(!s->hash) s->hash = str_hash_data(s->data,s->len);
+	return s->hash;
+}
+
+// Equal as by strcmp; interned strings are equal only if the same:
+int str_eq(str *s1,str *s2) {
+	if(s1==s2) return 1;
+	if(s1->flags&s2->flags&STR_INTERN) return 0;
+	if(str_hash(s1)!=str_hash(s2)) return 0;
+	return !str_cmp(s1,s2);
+}
+
+// As strcmp, ending views at their length:
+int str_cmp(str *s1,str *s2) {
+	const utf8_t *p1 = s1->data,*p2 = s2->data;
+	int i,n = s1->len<s2->len? s1->len : s2->len;
+	for(i=0; i<n && p1[i] && p1[i]==p2[i]; ++i);
+	return (i<s1->len? p1[i] : 0)-(i<s2->len? p2[i] : 0);
+}
+
 void str_free(str *s) {
 	if(s && !--s->ref) {
 //if(debug) q_outd(0,"str_free(%s)" STR_NL,s->data);
-		if(s->data) free(s->data);
+		if(s->flags&STR_INTERN) str_unintern(s);
+		if(s->flags&STR_VIEW) str_free(s->parent);
+#ifdef __unix__
+		else if(s->flags&STR_MAP) munmap(s->data,s->len);
+#endif
+		else if(s->data && !(s->flags&STR_INLINE)) free(s->data);
 		free(s);
 	}
 }
@@ -115,8 +307,48 @@ int str_len(const utf8_t *p) {
 	return i;
 }
 
-str *str_join(str *s1,str*s2) {
-	return str_dup(s1);
+// Grow data to hold at least n bytes, doubling the size:
+static int str_grow(str *s,int n) {
+	utf8_t *p;
+	if(n<=s->cap) return 1;
+	if(s->cap<=INT_MAX/2 && n<s->cap*2) n = s->cap*2;
+	if(s->flags&(STR_INLINE|STR_VIEW|STR_MAP)) { // Copy on write
+		if(!(p=(utf8_t *)malloc(n))) return 0;
+		memcpy(p,s->data,s->len);
+		p[s->len] = '\0';
+		if(s->flags&STR_VIEW) str_free(s->parent),s->parent = NULL;
+#ifdef __unix__
+		else if(s->flags&STR_MAP) munmap(s->data,s->len);
+#endif
+		s->flags &= ~(STR_INLINE|STR_VIEW|STR_MAP);
+	} else if(!(p=(utf8_t *)realloc(s->data,n))) return 0;
+	s->data = p,s->cap = n;
+	return 1;
+}
+
+str *str_join(const utf8_t *p1,int l1,const utf8_t *p2,int l2) {
+	str *r = str_new_dup((const utf8_t *)"",0);
+	if(l2>=INT_MAX-l1 || !str_grow(r,l1+l2+1)) return r;
+	memcpy(r->data,p1,l1);
+	memcpy(&r->data[l1],p2,l2);
+	r->len = l1+l2;
+	r->data[r->len] = '\0';
+	return r;
+}
+
+/* Append to s in place when it has no other references, else return a
+ * new string. The table holds no reference, so interned strings are removed. */
+str *str_append(str *s,const utf8_t *p,int l) {
+	int i = p>=s->data && p<=&s->data[s->len]? p-s->data : -1; // Appending from s itself
+	if(l>=INT_MAX-s->len) return s; // Too long, leave as is
+	if(s->ref>1) return str_join(s->data,s->len,p,l);
+	if(!str_grow(s,s->len+l+1)) return s;
+	if(i>=0) p = &s->data[i];
+	if(s->flags&STR_INTERN) str_unintern(s),s->flags &= ~STR_INTERN;
+	memmove(&s->data[s->len],p,l);
+	s->len += l,s->hash = 0;
+	s->data[s->len] = '\0';
+	return s;
 }
 
 int str_apply(utf8_t *p,str *s) {
@@ -124,37 +356,39 @@ int str_apply(utf8_t *p,str *s) {
 	return s->len;
 }
 
+// Latin letter A-Z of the character at p as 0-25, or -1; m is the length and v the value of greek and arabic letters:
+static int str_letter(const utf8_t *p,long n,int *m,int *v) {
+	const utf8_letter *g;
+	int c = *p;
+	*m = 1,*v = 0;
+	if(c>='A' && c<='Z') return c-'A';
+	if(c>='a' && c<='z') return c-'a';
+	if(!isunicode(c) || n<2 || !(g=utf8_lookup(p))->latin) return -1;
+	*m = 2,*v = g->value;
+	return g->latin-'A';
+}
+
 int str_val_sum(str *s,int l) {
 	int n = 0;
-	if(s && s->data && s->len) {
-		int i,j,k = 0,c0 = s->data[0],c1 = s->data[1];
-		int *v = hval;
-		int *vf = hvalf;
+	if(s && s->data && s->len && str_data(s)) {
+		const utf8_t *p = s->data;
+		int i,j,k = 0,c,c1,m,m1,v,v1;
 if(verbose) q_outv(0,"%s: \"%s\"" STR_NL,_("Calculate value sum of string"),s->data);
-		for(i=0; i<s->len && (!l || i<l) && c0; ++i,c0=c1,c1=s->data[i+1]) {
-			if(isunicode(c0)) {
-				c0 = utf8_decode(&s->data[i],&i);
-				if(c0>=0x5d0 && c0<=0x5ea) c0 = uh2l[c0-0x5d0]; // Hebrew unicode to latin
-				j = i,--i;
-				c1 = s->data[j];
-				if(isunicode(c1)) {
-					c1 = utf8_decode(&s->data[j],&j);
-					if(c1>=0x5d0 && c1<=0x5ea) c1 = uh2l[c1-0x5d0]; // Hebrew unicode to latin
+		for(i=0; i<s->len && (!l || i<l) && (c=p[i]); i+=m) {
+			if((c=str_letter(&p[i],s->len-i,&m,&v))<0) {
+				if(p[i]>='0' && p[i]<='9') {
+if(verbose) q_outv(0,"%c = %d" STR_NL,p[i],p[i]);
+					n += p[i]-'0',++k;
 				}
+				continue;
 			}
-			if(c0>='A' && c0<='Z') c0 -= 'A';
-			else if(c0>='a' && c0<='z') c0 -= 'a';
+			if(v) j = v; // Greek and arabic values
 			else {
-				if(c0>='0' && c0<='9') {
-if(verbose) q_outv(0,"%c = %d" STR_NL,c0,c0);
-					n += c0-'0',++k;
-				}
-				continue;
+				c1 = i+m<s->len? str_letter(&p[i+m],s->len-i-m,&m1,&v1) : -1;
+				j = c1>=0? hval[c] : hvalf[c]; // Final value at the end of a word
 			}
-			if(!vf || (c1>='A' && c1<='Z') || (c1>='a' && c1<='z')) j = v[c0];
-			else j = vf[c0];
 			if(j>0) {
-if(verbose) q_outv(0,"%c = %d" STR_NL,c0+'A',j);
+if(verbose) q_outv(0,"%c = %d" STR_NL,c+'A',j);
 				n += j,++k;
 			}
 		}
@@ -164,7 +398,7 @@ if(verbose) q_outv(0,"%s: %d" STR_NL,_("Result"),n);
 }
 
 int str_is_int(str *s) {
-	const utf8_t *p = s->data;
+	const utf8_t *p = str_data(s);
 	int c = *p;
 	if(c=='-') c = *++p;
 	do {
@@ -174,7 +408,7 @@ int str_is_int(str *s) {
 }
 
 int str_is_float(str *s) {
-	const utf8_t *p = s->data;
+	const utf8_t *p = str_data(s);
 	int c = *p,n = 0;
 	if(c=='-') c = *++p;
 	do { 
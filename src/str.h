@@ -70,9 +70,6 @@ enum {
 	TAU      // 21 T     Double  400     0xD7AA        
 };
 
-// Unicode Hebrew to Latin:
-extern int uh2l[];
-
 // Hebrew to Latin:
 extern int h2l[];
 
@@ -83,24 +80,64 @@ extern int l2h[];
 #define utf8_len(u)  (((u)&0x20)? (((u)&0x10)? (((u)&0x08)? (((u)&0x04)? (((u)&0x02)? 0 : 6) : 5) : 4) : 3) : 2)
 
 typedef unsigned char utf8_t;
+typedef struct utf8_letter utf8_letter;
+
+// Letter of a two byte UTF-8 character:
+struct utf8_letter {
+	char latin;  // Latin letter of the variable, or 0 if not a letter
+	char var;    // Variable index
+	short value; // Value of greek and arabic letters, 0 for the hebrew value of the latin letter
+};
+
+extern const utf8_letter utf8_table[][64];
+extern const unsigned char utf8_page[256];
+
+// Letter of the character at p, of at least two bytes; latin is 0 for other characters:
+#define utf8_lookup(p) (&utf8_table[((p)[1]&0xc0)==0x80? utf8_page[(p)[0]] : 0][(p)[1]&0x3f])
+
 typedef struct str str;
 
+#define STR_INLINE_LEN 16 // Size of inline data, including the terminating zero
+
+enum {
+	STR_INLINE = 1, // Data is stored in buf, and not allocated
+	STR_INTERN = 2, // String is in the intern table, unique by content
+	STR_VIEW   = 4, // Data is borrowed from parent, and not terminated by zero
+	STR_MAP    = 8  // Data is a read-only file mapping, and not terminated by zero
+};
+
 struct str {
-	char ref;      // Reference count
-	utf8_t *data;  // String data
-	int len;       // Length
+	int ref;       // Reference count
+	utf8_t *data;  // String data, pointing to buf for short strings
+	long len;      // Length, of a mapped script possibly over 2GB
+	long cap;      // Size of data, including the terminating zero
+	int flags;
+	unsigned hash; // Hash of data, or 0 if not yet calculated
+	str *parent;   // String holding the data of a view
+	utf8_t buf[STR_INLINE_LEN];
 };
 
 int utf8_decode(const utf8_t *s,int *i);
+int utf8_valid(const utf8_t *s,long n);
 
-#define str_data(s) ((s)->data)
+// Data terminated by zero; views are copied when first used as such:
+#define str_data(s) ((s)->flags&(STR_VIEW|STR_MAP)? str_cstr(s) : (s)->data)
 
 str *str_new(utf8_t *s,int l);
 str *str_new_dup(const utf8_t *s,int l);
+str *str_new_map(utf8_t *s,long l);
 void str_free(str *s);
 str *str_dup(str *s);
+str *str_view(str *s,long i,int l);
+utf8_t *str_cstr(str *s);
+str *str_intern(const utf8_t *s,int l);
+str *str_intern_view(str *s,long i,int l);
+unsigned str_hash(str *s);
+int str_eq(str *s1,str *s2);
+int str_cmp(str *s1,str *s2);
 int str_len(const utf8_t *p);
-str *str_join(str *s1,str*s2);
+str *str_join(const utf8_t *p1,int l1,const utf8_t *p2,int l2);
+str *str_append(str *s,const utf8_t *p,int l);
 int str_apply(utf8_t *p,str *s);
 int str_val_sum(str *s,int l);
 
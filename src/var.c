@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
 #include "q.h"
 #include "var.h"
@@ -87,22 +88,30 @@ double var_float(var *v) {
 	}
 }
 
-void var_num(var *v,const utf8_t *p,int *q) {
+/* Number of at most l bytes at p, which need not be terminated. The
+ * characters that strtol or strtod may read are copied and parsed there. */
+void var_num(var *v,const utf8_t *p,long l,int *q) {
+	char b[64],*s = b,*n;
+	long i;
 	int c;
-	char *n = (char *)&p[1];
 	var_free(v);
 	v->type = INT,v->i = 0;
-	for(; (c=*n); ++n) {
+	for(i=0; i<l; ++i)
+		if(!isalnum(c=p[i]) && c!='.' && c!='+' && c!='-') break;
+	if(i>=(long)sizeof(b) && !(s=(char *)malloc(i+1))) return;
+	memcpy(s,p,i),s[i] = '\0';
+	for(n=&s[1]; (c=*n); ++n) {
 		if(c>='0' && c<='9') continue;
 		if(c=='.' || c=='e') v->type = FLOAT;
 		break;
 	}
 	if(v->type==INT) {
-		v->i = strtol((char *)p,&n,0);
+		v->i = strtol(s,&n,0);
 	} else if(v->type==FLOAT) {
-		v->f = strtod((char *)p,&n);
+		v->f = strtod(s,&n);
 	}
-	if(q) *q += (int)(n-(char *)p)-1;
+	if(q) *q += (int)(n-s)-1;
+	if(s!=b) free(s);
 }
 
 void var_str(var *v,const utf8_t *p,int *q) {
@@ -158,13 +167,38 @@ int var_empty(var *v) {
 	return 1;
 }
 
+// Text of a variable for joining, as in templates:
+static const utf8_t *var_text(var *v,char *b,int n,int *l) {
+	if(v->type==STR) return *l = v->s->len,v->s->data;
+	if(v->type==INT) *l = snprintf(b,n,"%ld",v->i);
+	else if(v->type==FLOAT) *l = snprintf(b,n,"%g",v->f);
+	else *l = 1,b[0] = '?',b[1] = '\0';
+	return (const utf8_t *)b;
+}
+
+str *var_join(var *v0,var *v2,var *v1) {
+	char b1[32],b2[32];
+	const utf8_t *p1,*p2;
+	int l1,l2;
+	p1 = var_text(v1,b1,sizeof(b1),&l1);
+	if(v0==v2 && v2->type==STR) return str_append(v2->s,p1,l1);
+	p2 = var_text(v2,b2,sizeof(b2),&l2);
+	return str_join(p2,l2,p1,l1);
+}
+
+// Equality, short-circuiting strings on identity or hash:
+int var_eq(var *v,var *v1) {
+	if(v->type==STR && v1->type==STR) return str_eq(v->s,v1->s);
+	return var_cmp(v,v1)==0;
+}
+
 int var_cmp(var *v,var *v1) {
 	if(v==v1) return 0;
 	else if((v->type==VOID || v->type==INT) && (v1->type==VOID || v1->type==INT)) return v->i - v1->i;
 	else if((v->type==VOID || v->type==INT) && v1->type==FLOAT) return (int)ceil((double)v->i - v1->f);
 	else if(v->type==FLOAT && (v1->type==VOID || v1->type==INT)) return (int)ceil(v->f - (double)v1->i);
 	else if(v->type==FLOAT && v1->type==FLOAT) return (int)ceil(v->f - v1->f);
-	else if(v->type==STR && v1->type==STR) return strcmp((char *)str_data(v->s),(char *)str_data(v1->s));
+	else if(v->type==STR && v1->type==STR) return str_cmp(v->s,v1->s);
 	else if(v->type==STR) {
 		if(v1->type==VOID || v1->type==INT) {
 			if(str_is_int(v->s)) {
@@ -100,7 +100,7 @@ long var_ired(long n,long m);
 long var_int(var *v);
 
 double var_float(var *v);
-void var_num(var *v,const utf8_t *p,int *q);
+void var_num(var *v,const utf8_t *p,long l,int *q);
 void var_str(var *v,const utf8_t *p,int *q);
 void var_set(var *v,var *v1);
 void var_set_int(var *v,long i);
@@ -110,5 +110,14 @@ void var_set_str(var *v,str *s);
 int var_empty(var *v);
 int var_cmp(var *v,var *v1);
 
+/** Join V2 and V1 as strings, appending to the string of V2 in place if V0 is V2
+ * @param v0 Variable to be set, its string is not freed
+ * @param v2 Left operand
+ * @param v1 Right operand
+ * @return String with a reference for V0
+ */
+str *var_join(var *v0,var *v2,var *v1);
+int var_eq(var *v,var *v1);
+
 #endif /* _Q_VAR_H_ */
 